@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ * CircularQueue: lock free single producer single consumer ring buffer.
+ * Exactly one thread calls enQueue and exactly one thread calls deQueue.
+ * N is the number of elements the queue can hold, one extra slot tells full from empty.
+ */
+
+constexpr size_t CACHE_LINE = 64;
+
+template<typename T>
+void cleanup(T* pt) {
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+        pt->~T();
+    }
+}
+
+template<typename T, size_t N=100>
+class CircularQueue {
+    // start is written by the consumer and end by the producer, keep them on their own cache lines
+    alignas(CACHE_LINE) std::atomic<int> start;
+    alignas(CACHE_LINE) std::atomic<int> end;
+    alignas(CACHE_LINE) alignas(T) char arr[(N+1)*sizeof(T)];
+    
+public:
+    typedef T value_type;
+    CircularQueue(): start{0}, end{0} {
+        static_assert(N>0, "queue size must be positive");
+    }
+    ~CircularQueue() {
+        auto startv = start.load(std::memory_order_relaxed);
+        auto endv = end.load(std::memory_order_relaxed);
+        for(auto i=startv; i!=endv;){
+            cleanup((T*)(arr+sizeof(T)*i));
+            ++i;
+            if(i==N+1) i=0;
+        }
+    }
+
+    CircularQueue(const CircularQueue&) = delete;
+    CircularQueue& operator=(const CircularQueue&) = delete;
+
+    bool enQueue(const T& t) {
+        int startv = start.load(std::memory_order_acquire);
+        int endv = end.load(std::memory_order_relaxed);
+        int next = endv + 1;
+        if(next == N+1) next = 0;
+        if(next != startv) {
+            new(arr+endv*sizeof(T)) T(t); 
+            end.store(next, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+    
+    std::optional<T> deQueue() {
+        auto res = std::optional<T> {};
+        int startv = start.load(std::memory_order_relaxed);
+        int endv = end.load(std::memory_order_acquire);
+        if(startv!=endv) {
+            T* pt = (T*)(arr + startv*sizeof(T));
+            res.emplace(std::move(*pt));
+            cleanup(pt);
+            ++startv;
+            if(startv == N+1) startv = 0;
+            start.store(startv, std::memory_order_release);  // slot can be reused by the producer now
+        }
+        return res;
+    }
+
+    // consumer side: look at the front element without removing it. nullptr if the queue is empty
+    const T* front() const {
+        int startv = start.load(std::memory_order_relaxed);
+        int endv = end.load(std::memory_order_acquire);
+        return startv != endv ? (const T*)(arr + startv*sizeof(T)) : nullptr;
+    }
+
+    // consumer side: drop the front element, only valid after front() returned non null
+    void popFront() {
+        int startv = start.load(std::memory_order_relaxed);
+        cleanup((T*)(arr + startv*sizeof(T)));
+        ++startv;
+        if(startv == N+1) startv = 0;
+        start.store(startv, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return start.load(std::memory_order_acquire) == end.load(std::memory_order_acquire);
+    }
+};
@@ -24,6 +24,10 @@ Generator and Worker should run in its own threads.
 #include <optional>
 #include <atomic>
 #include <mutex>
+#include <vector>
+#include <string>
+
+#include "CircularQueue.hpp"
 
 using namespace std;
 using namespace std::chrono;
@@ -40,69 +44,6 @@ struct timer {
 };
 
 
-/*
- * CircularQueue definition
- */
-
-template<typename T>
-void cleanup(T* pt) {
-    pt->~T();
-}
-
-template<>
-void cleanup<timer>(timer* pt) {
-}
-
-template<typename T, size_t N=100>
-class CircularQueue {
-    atomic<int> start;
-    atomic<int> end;
-    char arr[(N+1)*sizeof(T)];
-    
-public:
-    typedef T value_type;
-    CircularQueue(): start{0}, end{0} {
-        static_assert(N>0, "queue size must be positive");
-    }
-    ~CircularQueue() {
-        auto startv = start.load(memory_order_relaxed);
-        auto endv = end.load(memory_order_relaxed);
-        for(auto i=startv; i!=endv;){
-            cleanup((T*)(arr+sizeof(T)*i));
-            ++i;
-            if(i==N+1) i=0;
-        }
-    }
-
-    bool enQueue(const T& t) {
-        int startv = start.load(memory_order_acquire);
-        int endv = end.load(memory_order_relaxed);
-        if((endv+1)%(N+1) != start) {
-            new(arr+endv*sizeof(T)) T(t); 
-            ++endv;
-            if(endv == N+1) endv = 0;
-            end.store(endv, memory_order_release);
-            return true;
-        }
-        return false;
-    }
-    
-    optional<T> deQueue() {
-        auto res = optional<T> {};
-        int startv = start.load(memory_order_relaxed);
-        int endv = end.load(memory_order_relaxed);
-        if(startv!=endv) {
-            T t = std::move(*(T*)(arr + startv*sizeof(T)));
-            cleanup((T*)(arr+startv*sizeof(T)));
-            ++startv;
-            if(startv == N+1) startv = 0;
-            start.store(startv, memory_order_relaxed);
-            res = std::move(optional<T>{t});
-        }
-        return res;
-    }
-};
-
 using Queue = CircularQueue<timer, 10>;
 Queue queue;
 
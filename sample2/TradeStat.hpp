@@ -20,7 +20,10 @@ struct Trade {
 
 class TradeStat {
 public:
-    void addTrade(const Trade& trade);
+    void addTrade(const Trade& trade) {
+        addTrade(trade.timestamp, trade.symbol, trade.quantity, trade.price);
+    }
+    void addTrade(long timestamp, const string& symbol, int quantity, long price);
     void addTrade(const string& msg) {
         Trade trade{msg};
         addTrade(trade);
@@ -43,7 +46,7 @@ friend std::ostream& operator<< (std::ostream& os, const TradeStat&);
 };
 
 
-Trade::Trade(const string& trade_msg){
+inline Trade::Trade(const string& trade_msg){
     std::istringstream iss(trade_msg);
     std::string s;
     int idx = 0;
@@ -68,25 +71,25 @@ Trade::Trade(const string& trade_msg){
     }
 }
 
-void TradeStat::addTrade(const Trade& trade) {
-    auto it = stats.find(trade.symbol);
+inline void TradeStat::addTrade(long timestamp, const string& symbol, int quantity, long price) {
+    auto it = stats.find(symbol);
     if(it!= stats.end()) {
         auto& stat = it->second;
-        stat.maxTimeGap = std::max(stat.maxTimeGap, trade.timestamp - stat.lastTime);
-        stat.lastTime = trade.timestamp;
-        stat.value += trade.quantity * trade.price;
-        stat.volume += trade.quantity;
-        if(stat.maxPrice < trade.price)
-            stat.maxPrice = trade.price;
+        stat.maxTimeGap = std::max(stat.maxTimeGap, timestamp - stat.lastTime);
+        stat.lastTime = timestamp;
+        stat.value += quantity * price;
+        stat.volume += quantity;
+        if(stat.maxPrice < price)
+            stat.maxPrice = price;
     }
     else {
-        symset.insert(trade.symbol);
-        stats[trade.symbol] = Stat{trade.timestamp, 0, trade.quantity*trade.price,
-                                   trade.price, trade.quantity};
+        symset.insert(symbol);
+        stats[symbol] = Stat{timestamp, 0, quantity*price,
+                             price, quantity};
     }
 }
 
-std::ostream& operator<< (std::ostream& os, const TradeStat& tstat) {
+inline std::ostream& operator<< (std::ostream& os, const TradeStat& tstat) {
     // format: <symbol>,<MaxTimeGap>,<Volume>,<WeightedAveragePrice>,<MaxPrice>
     for(auto& sym: tstat.symset) {
         auto& stat = tstat.stats.at(sym);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Doorbell lets the consumer of a lock free ring sleep while there is no work instead of spinning on it.
+// The consumer calls wait(ready) when it runs out of work: it polls ready() a bounded number of times,
+// yielding in between, then blocks until a producer calls ring(). A producer calls ring() after it made
+// work visible (an enqueue): a fence and a load while the consumer is awake, a lock and a notify only when
+// it sleeps. The fences on both sides make sure either the consumer sees the work or the producer sees the
+// sleeper, so no wakeup is lost.
+class Doorbell {
+public:
+    template<typename Ready>
+    void wait(Ready&& ready) {
+        if(spin(ready)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock, ready);
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    // like wait, but wakes up after timeout at the latest (for work a producer can not ring for,
+    // e.g. a flag set by a signal handler)
+    template<typename Ready, typename Rep, typename Period>
+    void waitFor(Ready&& ready, std::chrono::duration<Rep, Period> timeout) {
+        if(spin(ready)) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait_for(lock, timeout, ready);
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    void ring() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_all();
+        }
+    }
+
+private:
+    static constexpr int spinLimit = 64;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<bool> sleeping{false};
+
+    template<typename Ready>
+    static bool spin(Ready& ready) {
+        for(int i=0; i<spinLimit; ++i) {
+            if(ready()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// File primitives behind the MatchEngine journal and snapshots (see MatchEngine::enableJournal).
+// JournalWriter appends records to a file with group commit: records collect in a buffer and go to the file
+// with a single write and fdatasync once groupSize records are pending, or the oldest pending record has
+// waited commitInterval (checked when a record is appended), or on commit(). A record is durable after the
+// commit that carries it, the fsync cost is shared by the whole group.
+
+class JournalWriter {
+public:
+    struct Options {
+        size_t groupSize = 64;                          // records per commit
+        std::chrono::microseconds commitInterval{1000}; // commit when the oldest pending record is that old, 0: count only
+    };
+
+    // keep the first resumeAt bytes of the file (a journal recovered up to there) and append after them.
+    // resumeAt 0 starts a new journal
+    JournalWriter(const std::string& path, uint64_t resumeAt, const Options& opts_) : opts(opts_), committed(resumeAt) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if(fd < 0) {
+            throw std::runtime_error("Cannot open journal " + path);
+        }
+        if(ftruncate(fd, resumeAt) != 0 || lseek(fd, resumeAt, SEEK_SET) < 0) {  // drops a torn record at the end
+            close(fd);
+            throw std::runtime_error("Cannot position journal " + path);
+        }
+        buf.reserve(64 * 1024);
+    }
+
+    ~JournalWriter() {
+        commit();
+        close(fd);
+    }
+
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    // one record: a fixed size head and up to two variable parts
+    void append(const void* head, size_t headLen, const void* tail, size_t tailLen,
+                const void* tail2 = nullptr, size_t tail2Len = 0) {
+        if(pending == 0 && opts.commitInterval.count() > 0) {
+            firstPending = std::chrono::steady_clock::now();
+        }
+        auto used = buf.size();
+        buf.resize(used + headLen + tailLen + tail2Len);
+        memcpy(buf.data() + used, head, headLen);
+        if(tailLen) {  // memcpy must not get a null pointer, even for 0 bytes
+            memcpy(buf.data() + used + headLen, tail, tailLen);
+        }
+        if(tail2Len) {
+            memcpy(buf.data() + used + headLen + tailLen, tail2, tail2Len);
+        }
+        if(++pending >= opts.groupSize
+           || (opts.commitInterval.count() > 0 && std::chrono::steady_clock::now() - firstPending >= opts.commitInterval)) {
+            commit();
+        }
+    }
+
+    void commit() {
+        if(pending == 0) {
+            return;
+        }
+        const char* p = buf.data();
+        size_t left = buf.size();
+        while(left > 0) {
+            auto n = write(fd, p, left);
+            if(n < 0) {
+                throw std::runtime_error("Journal write failed");
+            }
+            p += n;
+            left -= n;
+        }
+        fdatasync(fd);
+        committed += buf.size();
+        buf.clear();
+        pending = 0;
+    }
+
+    uint64_t size() const { return committed + buf.size(); }  // bytes appended, committed or not
+    uint64_t committedSize() const { return committed; }
+
+private:
+    Options opts;
+    int fd;
+    uint64_t committed;  // bytes in the file
+    size_t pending = 0;  // records in buf
+    std::vector<char> buf;
+    std::chrono::steady_clock::time_point firstPending;
+};
+
+// replace path with data, so a reader sees either the old or the new file: temp file, fsync, rename
+inline void writeFileAtomically(const std::string& path, const char* data, size_t len) {
+    auto tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        throw std::runtime_error("Cannot open " + tmp);
+    }
+    while(len > 0) {
+        auto n = write(fd, data, len);
+        if(n < 0) {
+            close(fd);
+            throw std::runtime_error("Write failed " + tmp);
+        }
+        data += n;
+        len -= n;
+    }
+    fsync(fd);
+    close(fd);
+    if(rename(tmp.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Cannot rename " + tmp);
+    }
+    auto slash = path.rfind('/');
+    auto dir = slash == std::string::npos ? std::string(".") : path.substr(0, slash + 1);
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if(dfd >= 0) { // the rename itself must be durable too
+        fsync(dfd);
+        close(dfd);
+    }
+}
+
+// read the file from offset to the end. false if the file does not exist
+inline bool readFileFrom(const std::string& path, uint64_t offset, std::vector<char>& data) {
+    data.clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    auto end = lseek(fd, 0, SEEK_END);
+    if(end > 0 && uint64_t(end) > offset) {
+        data.resize(end - offset);
+        size_t got = 0;
+        while(got < data.size()) {
+            auto n = pread(fd, data.data() + got, data.size() - got, offset + got);
+            if(n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        data.resize(got);
+    }
+    close(fd);
+    return true;
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Per stage latency of the messages processed by MatchEngine.
+// Build with -DME_LATENCY_STATS to turn it on. Without it LatencyRecorder is an empty class whose calls compile
+// to nothing, so the instrumentation points can stay in the engine at zero cost.
+// A message is timed with the time stamp counter from start() to finish(). mark(stage) charges the time since
+// the previous mark to stage, a stage hit several times in one message (e.g. MODIFY: cancel then insert) adds up.
+// Every stage and the total go to a log-linear histogram per message type.
+// The histograms are printed by dump(), on exit, or by every recorder at its next message after SIGUSR1
+// (see requestLatencyDump). Time spent on a message outside start()/finish(), e.g. parsing a whole batch
+// ahead, is charged with add().
+
+#ifdef ME_LATENCY_STATS
+constexpr bool latencyStatsEnabled = true;
+#else
+constexpr bool latencyStatsEnabled = false;
+#endif
+
+enum class LatencyStage {
+    PARSE,     // text split / binary decode
+    LOOKUP,    // order id index
+    MATCH,     // walking the opposite book, executeLevel
+    BOOK,      // level insert / cancel / reduce, level creation and removal
+    PUBLISH,   // handing trades and book dumps to the publisher
+    TOTAL,     // start to finish
+    COUNT
+};
+
+inline const char* latencyStageName(size_t stage) {
+    static const char* names[] = {"parse", "lookup", "match", "book", "publish", "total"};
+    return names[stage];
+}
+
+inline uint64_t readTimestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// counted up from a signal handler, every recorder dumps at its next message boundary once per request
+inline std::atomic<uint64_t>& latencyDumpRequests() {
+    static std::atomic<uint64_t> requests{0};
+    return requests;
+}
+
+inline void requestLatencyDump(int) {
+    latencyDumpRequests().fetch_add(1, std::memory_order_relaxed);
+}
+
+// LogLinearHistogram: 16 linear sub buckets per power of two, about 6% resolution over the whole range
+class LogLinearHistogram {
+public:
+    static constexpr int subBits = 4;
+    static constexpr int maxExp = 48;
+    static constexpr size_t buckets = (maxExp - subBits + 2) << subBits;
+
+    void record(uint64_t v) {
+        ++counts[index(v)];
+        ++total;
+        if(v > maxValue) {
+            maxValue = v;
+        }
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxValue; }
+
+    // upper bound of the bucket holding the q quantile (0 < q <= 1)
+    uint64_t quantile(double q) const {
+        uint64_t rank = uint64_t(q * total + 0.5);
+        if(rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for(size_t i=0; i<buckets; ++i) {
+            seen += counts[i];
+            if(seen >= rank) {
+                return std::min(upperBound(i), maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+private:
+    uint64_t counts[buckets] = {};
+    uint64_t total = 0;
+    uint64_t maxValue = 0;
+
+    static size_t index(uint64_t v) {
+        if(v < (1u << subBits)) {
+            return v;
+        }
+        int e = 63 - __builtin_clzll(v);
+        if(e > maxExp) {
+            return buckets - 1;
+        }
+        return (size_t(e - subBits + 1) << subBits) + ((v >> (e - subBits)) & ((1u << subBits) - 1));
+    }
+
+    static uint64_t upperBound(size_t i) {
+        if(i < (1u << subBits)) {
+            return i;
+        }
+        int e = int(i >> subBits) + subBits - 1;
+        uint64_t sub = i & ((1u << subBits) - 1);
+        return (((1ull << subBits) + sub + 1) << (e - subBits)) - 1;
+    }
+};
+
+template<bool Enabled, size_t Types>
+class LatencyRecorderT {
+public:
+    void start() {}
+    void mark(LatencyStage) {}
+    void add(LatencyStage, uint64_t) {}
+    void finish(size_t) {}
+    void setTypeNames(const char* const*) {}
+    void setLabel(std::string_view) {}
+    void dump(std::ostream&, const char* const*) {}
+};
+
+template<size_t Types>
+class LatencyRecorderT<true, Types> {
+public:
+    LatencyRecorderT() : dumpsSeen(latencyDumpRequests().load(std::memory_order_relaxed)),
+                         tscStart(readTimestamp()), clockStart(std::chrono::steady_clock::now()) {}
+
+    void start() {
+        begin = last = readTimestamp();
+        memset(stageTicks, 0, sizeof(stageTicks));
+        memset(stageHit, 0, sizeof(stageHit));
+    }
+
+    void mark(LatencyStage stage) {
+        auto now = readTimestamp();
+        stageTicks[size_t(stage)] += now - last;
+        stageHit[size_t(stage)] = true;
+        last = now;
+    }
+
+    // ticks spent on the message before start(), they count for the stage and the total
+    void add(LatencyStage stage, uint64_t ticks) {
+        stageTicks[size_t(stage)] += ticks;
+        stageHit[size_t(stage)] = true;
+        begin -= ticks;
+    }
+
+    void finish(size_t type) {
+        auto now = readTimestamp();
+        if(type >= Types) {
+            type = Types - 1;
+        }
+        for(size_t s=0; s<size_t(LatencyStage::TOTAL); ++s) {
+            if(stageHit[s]) {
+                hist[type][s].record(stageTicks[s]);
+            }
+        }
+        hist[type][size_t(LatencyStage::TOTAL)].record(now - begin);
+        auto requests = latencyDumpRequests().load(std::memory_order_relaxed);
+        if(requests != dumpsSeen) {
+            dumpsSeen = requests;
+            static std::mutex dumpMutex;  // recorders of several matching threads dump to the same stream
+            std::lock_guard<std::mutex> lock(dumpMutex);
+            dump(std::cerr, dumpNames);
+        }
+    }
+
+    void setTypeNames(const char* const* names) { dumpNames = names; }
+    void setLabel(std::string_view label_) { label = label_; }  // printed ahead of the dump, e.g. the symbol
+
+    // percentiles in nanoseconds, per message type and stage
+    void dump(std::ostream& os, const char* const* typeNames) {
+        double nsPerTick = ticksToNs();
+        auto ns = [nsPerTick](uint64_t ticks) { return uint64_t(ticks * nsPerTick + 0.5); };
+        if(!label.empty()) {
+            os << label << ":\n";
+        }
+        os << "latency (ns)          count      p50      p90      p99    p99.9      max\n";
+        for(size_t t=0; t<Types; ++t) {
+            for(size_t s=0; s<size_t(LatencyStage::COUNT); ++s) {
+                auto& h = hist[t][s];
+                if(h.count() == 0) {
+                    continue;
+                }
+                os << std::left << std::setw(7) << (typeNames ? typeNames[t] : "") << " "
+                   << std::setw(8) << latencyStageName(s) << std::right
+                   << std::setw(11) << h.count()
+                   << std::setw(9) << ns(h.quantile(0.5))
+                   << std::setw(9) << ns(h.quantile(0.9))
+                   << std::setw(9) << ns(h.quantile(0.99))
+                   << std::setw(9) << ns(h.quantile(0.999))
+                   << std::setw(9) << ns(h.max()) << "\n";
+            }
+        }
+        os.flush();
+    }
+
+private:
+    uint64_t begin = 0;
+    uint64_t last = 0;
+    uint64_t stageTicks[size_t(LatencyStage::COUNT)] = {};
+    bool stageHit[size_t(LatencyStage::COUNT)] = {};
+    LogLinearHistogram hist[Types][size_t(LatencyStage::COUNT)];
+    const char* const* dumpNames = nullptr;
+    std::string label;
+    uint64_t dumpsSeen;
+    uint64_t tscStart;
+    std::chrono::steady_clock::time_point clockStart;
+
+    double ticksToNs() const {
+        // calibrated over the life of the recorder, no start up delay
+        auto ticks = readTimestamp() - tscStart;
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - clockStart).count();
+        return ticks ? double(elapsed) / ticks : 1.0;
+    }
+};
+
+template<size_t Types>
+using LatencyRecorder = LatencyRecorderT<latencyStatsEnabled, Types>;
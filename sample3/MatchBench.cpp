@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "MatchEngine.hpp"
+#include "OrderFlowGenerator.hpp"
+
+// Replay a synthetic flow through MatchEngine and report throughput and per message latency.
+// The flow is generated up front, so the run measures the engine only (parse, match, publish). The output
+// goes to a checksum, which stays the same for the same flow whatever book or pool is behind the engine:
+// --expect <checksum> turns the run into a golden check against a checksum taken from a known good build.
+
+int main(int argc, char* argv[]) {
+    OrderFlowConfig cfg;
+    size_t messages = 1000000;
+    size_t warmup = 100000;
+    bool binary = false;
+    auto pubMode = TradePublisher::Mode::INLINE;
+    OrderMemoryPool::Options poolOpts{256};
+    const char* expect = nullptr;
+    size_t topLevels = 0;
+    size_t readers = 0;
+    size_t batch = 0;
+    for(int i=1; i<argc; ++i) {
+        string_view arg = argv[i];
+        if(arg == "--messages" && i+1 < argc) {
+            messages = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(arg == "--warmup" && i+1 < argc) {
+            warmup = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(arg == "--binary") {
+            binary = true;
+        }
+        else if(arg == "--async-output") {
+            pubMode = TradePublisher::Mode::ASYNC;
+        }
+        else if(arg == "--hugepages") {
+            poolOpts.hugePages = true;
+        }
+        else if(arg == "--prefault") {
+            poolOpts.prefault = true;
+        }
+        else if(arg == "--batch" && i+1 < argc) {
+            batch = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(arg == "--top-of-book" && i+1 < argc) {
+            topLevels = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(arg == "--readers" && i+1 < argc) {
+            readers = strtoul(argv[++i], nullptr, 10);
+        }
+        else if(arg == "--expect" && i+1 < argc) {
+            expect = argv[++i];
+        }
+        else if(i+1 < argc && setFlowOption(cfg, arg, argv[i+1])) {
+            ++i;
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--messages n] [--warmup n] [--binary] [--batch K] [--async-output] [--hugepages] [--prefault]"
+                      << " [--top-of-book levels [--readers n]] [--expect checksum] [options]\n" << flowOptionsHelp();
+            return -1;
+        }
+    }
+
+    string flow;
+    OrderFlowGenerator gen(cfg);
+    gen.generate(warmup + messages, flow);
+    vector<string_view> lines;
+    lines.reserve(warmup + messages);
+    for(size_t start=0, nl; (nl = flow.find('\n', start)) != string::npos; start = nl + 1) {
+        lines.emplace_back(flow.data() + start, nl - start);
+    }
+    vector<BinaryMessage> records;
+    if(binary) { // every generated message is valid, one record per line
+        records.resize(lines.size());
+        for(size_t i=0; i<lines.size(); ++i) {
+            OrderMessage m;
+            parseInputLine(lines[i], m);
+            encodeMessage(m, records[i]);
+        }
+    }
+
+    OutputChecksum checksum;
+    ostream out(&checksum);
+    MatchEngine engine(std::cin, out, poolOpts, pubMode);
+    auto process = [&](size_t i) {
+        if(binary) {
+            engine.processBinaryMessage(records[i]);
+        }
+        else {
+            engine.processInputLine(lines[i]);
+        }
+    };
+    for(size_t i=0; i<warmup; ++i) {
+        process(i);
+    }
+
+    // reader threads polling the published top of book while the engine runs
+    atomic<bool> stop{false};
+    vector<uint64_t> reads(readers, 0);
+    vector<std::thread> readerThreads;
+    if(topLevels > 0) {
+        auto& top = engine.enableTopOfBook(topLevels);
+        for(size_t r=0; r<readers; ++r) {
+            readerThreads.emplace_back([&top, &stop, &reads, r]() {
+                uint64_t n = 0;
+                while(!stop.load(memory_order_relaxed)) {
+                    top.read();
+                    ++n;
+                }
+                reads[r] = n;
+            });
+        }
+    }
+
+    LogLinearHistogram hist;
+    auto clockStart = chrono::steady_clock::now();
+    auto tscStart = readTimestamp();
+    if(batch > 1) { // the latency of a message is its share of the batch
+        for(size_t i=warmup; i<lines.size(); i+=batch) {
+            size_t n = min(batch, lines.size() - i);
+            auto t = readTimestamp();
+            if(binary) {
+                engine.processBinaryBatch(&records[i], n);
+            }
+            else {
+                engine.processInputBatch(&lines[i], n);
+            }
+            auto share = (readTimestamp() - t) / n;
+            for(size_t k=0; k<n; ++k) {
+                hist.record(share);
+            }
+        }
+    }
+    else {
+        for(size_t i=warmup; i<lines.size(); ++i) {
+            auto t = readTimestamp();
+            process(i);
+            hist.record(readTimestamp() - t);
+        }
+    }
+    engine.flush();
+    stop = true;
+    for(auto& t: readerThreads) {
+        t.join();
+    }
+    auto ticks = readTimestamp() - tscStart;
+    auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - clockStart).count();
+    double nsPerTick = ticks ? elapsed * 1e9 / ticks : 1.0;
+    auto ns = [nsPerTick](uint64_t t) { return uint64_t(t * nsPerTick + 0.5); };
+
+    char sum[17];
+    snprintf(sum, sizeof(sum), "%016" PRIx64, checksum.value());
+    std::cout << "messages      " << messages << (binary ? " binary" : " text")
+              << (batch > 1 ? ", batches of " + to_string(batch) + " (latency is the batch average)" : "") << "\n"
+              << "elapsed (s)   " << elapsed << "\n"
+              << "msgs/sec      " << uint64_t(messages / elapsed) << "\n"
+              << "latency (ns)  p50 " << ns(hist.quantile(0.5)) << "  p99 " << ns(hist.quantile(0.99))
+              << "  p99.9 " << ns(hist.quantile(0.999)) << "  max " << ns(hist.max()) << "\n"
+              << (topLevels ? "top of book   " + to_string(topLevels) + " levels, " + to_string(readers) + " readers, "
+                              + to_string(uint64_t(accumulate(reads.begin(), reads.end(), uint64_t(0)) / elapsed)) + " reads/sec\n" : "")
+              << "output        " << checksum.bytes() << " bytes, checksum " << sum << "\n";
+    if(expect) {
+        bool same = string_view(expect) == sum;
+        std::cout << "golden check  " << (same ? "OK" : "FAILED") << "\n";
+        return same ? 0 : 1;
+    }
+    return 0;
+}
@@ -1,561 +1,336 @@
-#include <map>
-#include <list>
-#include <queue>
-#include <string>
-#include <string_view>
-#include <vector>
-#include <cassert>
 #include <fstream>
-#include <sstream>
+#include <functional>
 #include <iostream>
-#include <algorithm>
-#include <unordered_map>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
 
-using namespace std;
+#include "MatchEngine.hpp"
+#include "ShardedMatchEngine.hpp"
 
-enum class OrderSide {
-    BUY,
-    SELL,
-    UNKNOWN
-};
+static TradeStatFeed* tradeStatsFeed = nullptr;
 
-inline OrderSide getOrderSide(string_view sstr) {
-    if(sstr == "BUY") {
-        return OrderSide::BUY;
+static void requestTradeStats(int) {
+    if(tradeStatsFeed) {
+        tradeStatsFeed->requestSnapshot();
     }
-    else if(sstr == "SELL") {
-        return OrderSide::SELL;
-    }
-    return OrderSide::UNKNOWN;
 }
 
-enum class OrderType {
-    IOC,
-    GFD,
-    MKT,
-    UNKNOWN
-};
+// an ostream to tie cerr to: before a Bad input line is written, the output of the messages before it is
+// written too, so stdout and stderr interleave in input order when they go to the same place
+class FlushHook : public streambuf {
+public:
+    explicit FlushHook(function<void()> f_) : f(std::move(f_)) {}
 
-inline OrderType getOrderType(string_view otstr) {
-    if(otstr == "IOC") {
-        return OrderType::IOC;
+protected:
+    int sync() override {
+        f();
+        return 0;
     }
-    else if(otstr == "GFD") {
-        return OrderType::GFD;
-    }
-    return OrderType::UNKNOWN;
-}
-
-enum class MessageType {
-    NEW,
-    CANCEL,
-    MODIFY,
-    PRINT,
-    UNKNOWN
-};
-
-inline MessageType getMessageType(string_view tstr) {
-        if(tstr == "NEW") {
-            return MessageType::NEW;
-        }
-        else if (tstr == "CANCEL") {
-            return MessageType::CANCEL;
-        }
-        else if (tstr == "MODIFY") {
-            return MessageType::MODIFY;
-        }
-        else if (tstr == "PRINT") {
-            return MessageType::PRINT;
-        }        
-        return MessageType::UNKNOWN;
-}
 
-struct Order {
-    OrderSide side;
-    OrderType type;
-    unsigned long price;
-    int quantity;   // the original order quantity, assigned when initialized
-    int leaves;     // leaves initialized with original quantity. will change when trade happens. 
-    string orderId;
-    bool doneFlag;  // when doneFlag is true (set when order is canceled or fully filled), order is finished. and no further action
+private:
+    function<void()> f;
 };
 
-class TradeDetail {
+// ScopedTie ties a stream to another for its lifetime and puts the previous tie back when destroyed, so a
+// stream that outlives main is never left tied to a local
+class ScopedTie {
 public:
-    TradeDetail(const std::string& orderIdBook_, unsigned long priceBook_, const std::string& orderIdComing_,
-                unsigned long priceComing_, int fillQty_) :
-               orderIdBook(orderIdBook_)
-               , priceBook(priceBook_)
-               , orderIdComing(orderIdComing_)
-               , priceComing(priceComing_)
-               , fillQty(fillQty_)
-               {}
+    ScopedTie(ios& s_, ostream* tie) : s(s_), prev(s_.tie(tie)) {}
+    ~ScopedTie() { s.tie(prev); }
+    ScopedTie(const ScopedTie&) = delete;
+    ScopedTie& operator=(const ScopedTie&) = delete;
 
 private:
-    std::string orderIdBook;
-    unsigned long priceBook;
-    std::string orderIdComing;
-    unsigned long priceComing;
-    int fillQty;
-
-friend void printTrade (ostream& os, const TradeDetail& trade);
-
+    ios& s;
+    ostream* prev;
 };
 
-void printTrade(ostream& os, const TradeDetail& trade) {
-    os << "TRADE"
-       << " " << trade.orderIdBook
-       << " " << trade.priceBook
-       << " " << trade.fillQty
-       << " " << trade.orderIdComing
-       << " " << trade.priceComing
-       <<"\n";
-}
-
-class PriceLevel {
+// MappedFile maps a whole file read only, for replaying binary input without copying it
+class MappedFile {
 public:
-    PriceLevel(unsigned long price_): price(price_), quantity(0) {}
-    unsigned long getPrice() const {return price;}
-    int getQuantity() const { return quantity;}
-    
-    list<Order*>::iterator addOrder(Order* porder) { // add to the end of list and return the iterator
-        assert(porder != nullptr);
-        assert(porder->price == price);
-        orderList.push_back(porder);
-        quantity += porder->leaves;
-        return --(orderList.end());
+    explicit MappedFile(const char* path) : addr{nullptr}, len{0} {
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            throw runtime_error(string("Cannot open ") + path);
+        }
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            len = st.st_size;
+            addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        }
+        close(fd);
+        if(addr == MAP_FAILED) {
+            throw runtime_error(string("Cannot map ") + path);
+        }
+        if(addr) {
+            madvise(addr, len, MADV_SEQUENTIAL);
+        }
     }
-    
-    int executeLevel(const std::string& incomingOrderId, unsigned long price, int qty, vector<TradeDetail>& trades) {
-        // the logic to decide whether to execute at this level is in OrderBook tryMatchOrder function
-        assert(qty >= 0 );
-        auto it = orderList.begin();
-        while(it!=orderList.end() && qty>0) {
-            auto& order = *(orderList.front());
-            if(order.doneFlag) {
-                orderList.pop_front();
-            }
-            else {
-                auto execQty = min (order.leaves, qty);
-                trades.push_back(TradeDetail{order.orderId, order.price, incomingOrderId, price, execQty});
-                quantity -= execQty;
-                qty -= execQty;
-                order.leaves -= execQty;
-                if(order.leaves == 0) {
-                    order.doneFlag = true;
-                    orderList.pop_front();
-                }
-            }
-            it = orderList.begin();
+    ~MappedFile() {
+        if(addr) {
+            munmap(addr, len);
         }
-        return qty;  // return leaves
-    } 
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-private:
-    unsigned long price;
-    int quantity;
-    list<Order*> orderList;
+    const char* data() const { return (const char*)addr; }
+    size_t size() const { return len; }
 
-friend class OrderBook;
-        
+private:
+    void* addr;
+    size_t len;
 };
 
-
-class OrderBook {
-    // only GFD order goes into an order book
-public:
-    list<Order*>::iterator addOrder(Order* porder) {
-        PriceLevel& level = getLevelCreate(porder->price);
-        return level.addOrder(porder);
-    }
-    
-    bool cancelOrder(Order* porder) {
-        auto plevel = getLevel(porder->price);
-        if(plevel) {
-            plevel->quantity -= porder->leaves; 
-            if(plevel->quantity == 0) {
-                levelMap.erase(porder->price);
-            }
-            return true;
+int main(int argc, char* argv[]) {
+    /* Read input from STDIN (or the given file). Print output to STDOUT */
+    OrderMemoryPool::Options poolOpts{256};
+    bool binary = false;
+    bool toBinary = false;
+    bool symbols = false;
+    auto pubMode = TradePublisher::Mode::ASYNC;
+    auto pubFormat = TradePublisher::Format::TEXT;
+    size_t shards = max(3u, std::thread::hardware_concurrency()) - 2;  // leave a core for the gateway and one for output
+    const char* inputFile = nullptr;
+    const char* depthFile = nullptr;
+    size_t topLevels = 5;
+    long topInterval = 0;
+    const char* journalFile = nullptr;
+    const char* snapshotFile = nullptr;
+    uint64_t snapshotEvery = 100000;
+    JournalWriter::Options journalOpts;
+    bool recover = false;
+    size_t batch = 0;
+    const char* tradeStatsFile = nullptr;
+    const char* statsSymbol = "ME";
+    bool latencyPerSymbol = false;
+    vector<string_view> singleSymbolOnly;  // options given that the multi-symbol engine does not have
+    auto usage = [argv]() {
+        std::cerr << "Usage: " << argv[0] << " [--hugepages] [--prefault] [--binary | --to-binary] [--symbols] [--shards N] [--latency-per-symbol] [--sync-output] [--raw-output] [--batch K]"
+                  << " [--depth-out file [--top N] [--top-interval ms]]"
+                  << " [--journal file [--group-commit N] [--commit-us us] [--snapshot file [--snapshot-every N]] [--recover]]"
+                  << " [--trade-stats file [--stats-symbol name]] [inputfile]" << std::endl;
+        return -1;
+    };
+    for(int i=1; i<argc; ++i) {
+        string_view arg = argv[i];
+        if(arg == "--hugepages") {
+            poolOpts.hugePages = true;
+        }
+        else if(arg == "--prefault") {
+            poolOpts.prefault = true;
+        }
+        else if(arg == "--binary") {
+            binary = true;
+        }
+        else if(arg == "--to-binary") {
+            toBinary = true;
+        }
+        else if(arg == "--sync-output") {
+            pubMode = TradePublisher::Mode::INLINE;
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--raw-output") {
+            pubFormat = TradePublisher::Format::RAW;
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--depth-out" && i+1 < argc) {
+            depthFile = argv[++i];
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--top" && i+1 < argc && atoi(argv[i+1]) > 0) {
+            topLevels = atoi(argv[++i]);
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--top-interval" && i+1 < argc && atol(argv[i+1]) > 0) {
+            topInterval = atol(argv[++i]);
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--journal" && i+1 < argc) {
+            journalFile = argv[++i];
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--snapshot" && i+1 < argc) {
+            snapshotFile = argv[++i];
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--snapshot-every" && i+1 < argc && atol(argv[i+1]) > 0) {
+            snapshotEvery = atol(argv[++i]);
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--group-commit" && i+1 < argc && atoi(argv[i+1]) > 0) {
+            journalOpts.groupSize = atoi(argv[++i]);
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--commit-us" && i+1 < argc && atol(argv[i+1]) >= 0) {
+            journalOpts.commitInterval = chrono::microseconds(atol(argv[++i]));
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--recover") {
+            recover = true;
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--batch" && i+1 < argc && atoi(argv[i+1]) > 0) {
+            batch = atoi(argv[++i]);
+            singleSymbolOnly.push_back(arg);
+        }
+        else if(arg == "--trade-stats" && i+1 < argc) {
+            tradeStatsFile = argv[++i];
+        }
+        else if(arg == "--stats-symbol" && i+1 < argc) {
+            statsSymbol = argv[++i];
+        }
+        else if(arg == "--symbols") {
+            symbols = true;
+        }
+        else if(arg == "--shards" && i+1 < argc && atoi(argv[i+1]) > 0) {
+            symbols = true;
+            shards = atoi(argv[++i]);
+        }
+        else if(arg == "--latency-per-symbol") {
+            latencyPerSymbol = true;
+        }
+        else if(arg[0] != '-' && !inputFile) {
+            inputFile = argv[i];
+        }
+        else {
+            return usage();
         }
-        return false;
     }
-    
-    bool reduceOrder(Order* porder, int delta) {
-        assert(delta >= 0);
-        auto plevel = getLevel(porder->price);
-        if(plevel) {
-            plevel->quantity -= delta;
-            return true;
-        }
-        return false;
+    if(symbols && !singleSymbolOnly.empty()) {
+        std::cerr << singleSymbolOnly.front() << " is not supported with --symbols or --shards\n";
+        return usage();
     }
- 
-    void printBook(ostream& os) {
-        // print book from higher price to lower price
-        for(auto it=levelMap.rbegin(); it!=levelMap.rend(); ++it) {
-            os << it->second.price
-               << " " << it->second.quantity
-               << "\n";
-        }
+    if((recover || snapshotFile) && !journalFile) {
+        std::cerr << (recover ? "--recover" : "--snapshot") << " needs --journal\n";
+        return usage();
     }
-    pair<bool, int> tryMatchOrder(Order& order, vector<TradeDetail>& trades); //bool to indicate if match happened, and unsigned long the matched quantity
-    
-private:
-    map<unsigned long, PriceLevel> levelMap;   // price to PriceLevel map. alternatively different data structure can be used 
-    PriceLevel* getLevel(unsigned long price) {
-        auto it = levelMap.find(price);
-        if(it != levelMap.end()) {
-            return &(it->second); 
-        }
-        return nullptr;
+    if(latencyPerSymbol && !symbols) {
+        std::cerr << "--latency-per-symbol needs --symbols or --shards\n";
+        return usage();
     }
-    PriceLevel& getLevelCreate(unsigned long price) { //if level for the price does not exist, create a new Pricelevel
-        auto plevel = getLevel(price);
-        if(plevel) {
-            return *plevel;
-        }
-        auto [it, flag] = levelMap.insert(make_pair(price, PriceLevel(price)));
-        if(! flag) { // insert fail. something really bad happened
-            throw runtime_error("LevelMap insert failure");
-        }
-        return it->second;
+    ios::sync_with_stdio(false);
+    if(symbols || pubMode == TradePublisher::Mode::ASYNC) {
+        std::cin.tie(nullptr);  // an output thread owns cout. it flushes whenever it runs out of work
     }
-    
-    PriceLevel* getTopOfBook(OrderSide side) {
-        if(!levelMap.empty()) {
-            return side==OrderSide::BUY ? &((--(levelMap.end()))->second) : &(levelMap.begin()->second);
+    std::cerr.tie(nullptr);  // see below, single symbol output keeps the order of bad input reports
+    ifstream ifs;
+    if(inputFile && !(binary && !toBinary)) {
+        ifs.open(inputFile);
+        if(!ifs) {
+            std::cerr << "Cannot open " << inputFile << std::endl;
+            return -1;
         }
-        return nullptr;
     }
-    
-    void removeTopOfBook(OrderSide side) {
-        if(!levelMap.empty()) {
-            if(side == OrderSide::BUY) { 
-                levelMap.erase(--(levelMap.end()));
-            }
-            else {
-                levelMap.erase(levelMap.begin());
+    istream& is = inputFile ? ifs : std::cin;
+    if(toBinary) {
+        convertTextToBinary(is, std::cout, symbols);
+        return 0;
+    }
+    // trade statistics: written on SIGUSR2 and at the end. the feed outlives the engines
+    unique_ptr<TradeStatFeed> tradeStats;
+    if(tradeStatsFile) {
+        tradeStats = make_unique<TradeStatFeed>(symbols ? shards : 1);
+        tradeStats->setSnapshotFile(tradeStatsFile);
+        tradeStatsFeed = tradeStats.get();
+        signal(SIGUSR2, requestTradeStats);
+    }
+    auto writeTradeStats = [&]() {
+        if(tradeStats) {
+            tradeStats->drain();
+            tradeStats->writeSnapshotTo(tradeStatsFile);
+            if(tradeStats->dropped()) {
+                std::cerr << tradeStats->dropped() << " trades dropped from the trade statistics\n";
             }
         }
+    };
+    if(latencyStatsEnabled) {
+        signal(SIGUSR1, requestLatencyDump);
     }
-    
-    template<OrderSide side>
-    std::pair<bool, int> tryMatchOrderImpl(Order& order, vector<TradeDetail>& trades) {
-        auto levelPriceGoodForMatch = [] (PriceLevel* plevel, Order& order) { //side is the opposite of order side
-            if constexpr (side == OrderSide::SELL) {
-                return plevel->price <= order.price;
-            }
-            if constexpr (side == OrderSide::BUY) {
-                return plevel->price >= order.price;
-            }
-        };
-        auto plevel = getTopOfBook(side);
-        auto leaves = order.leaves;
-        while (leaves>0 && plevel && levelPriceGoodForMatch(plevel, order)) {
-            leaves = plevel->executeLevel(order.orderId, order.price, leaves, trades);
-            if(plevel->quantity == 0) {
-                removeTopOfBook(side);
-            }
-            if(leaves >0) {
-                plevel = getTopOfBook(side);
-            }
+    if(symbols) {
+        // symbols are many and mostly small: small slabs, with the huge page options given
+        ShardedMatchEngine engine(shards, is, std::cout, 1, tradeStats.get(),
+                                  OrderMemoryPool::Options{64, 1, poolOpts.hugePages, poolOpts.prefault}, latencyPerSymbol);
+        if(binary && inputFile) {
+            MappedFile file(inputFile);
+            engine.runBinary((const BinaryMessage*)file.data(), file.size() / sizeof(BinaryMessage));
         }
-        if(leaves == order.leaves) { // no fill happened
-            return {false, 0};
+        else if(binary) {
+            engine.runBinary();
         }
-        auto filled = order.leaves - leaves;
-        assert(filled > 0);
-        order.leaves = leaves;
-        return {true, filled};           
-    } 
-        
-};
-
-std::pair<bool, int> OrderBook::tryMatchOrder(Order& order, vector<TradeDetail>& trades) {
-    // The order is on the side of the book
-    switch(order.side) {
-        case OrderSide::BUY:
-            return tryMatchOrderImpl<OrderSide::SELL>(order, trades);
-        case OrderSide::SELL:
-            return tryMatchOrderImpl<OrderSide::BUY>(order, trades);
-        default:
-            break;
-    }
-    return {false, 0};
-}
-
-// OrderMemoryPool provide memory to hold Orders.
-// This MemoryPool only hand out allocated memory to create a new order. and does not reclaim until the pool is cleaned 
-class OrderMemoryPool {
-public:
-    OrderMemoryPool(size_t sz = 1024) : currIdx{0} {
-        allocations.push_back(pair<void*, size_t> {malloc(sizeof(Order)*sz), sz});
-    }
-    
-    ~OrderMemoryPool() {
-        int N=allocations.size();
-        for(int i=0; i<N-1; ++i) {
-            auto [p, sz] = allocations[i];
-            for(size_t j=0; j<sz; ++j) {
-                ((Order*)p + j)->~Order();
-            }
-            free(p);
+        else {
+            engine.run();
         }
-        auto [p, sz] = allocations.back();
-        for(size_t j=0; j<currIdx; ++j) {
-            ((Order*)p + j)->~Order();
+        if(latencyStatsEnabled) {
+            engine.dumpLatency(std::cerr);
         }
-        free(p);
+        writeTradeStats();
+        return 0;
     }
-    
-    void* getNext() {
-        auto p = allocations.back();
-        if(currIdx == p.second) {  // memory used out, need more allocation 
-            auto newsz = p.second * 2;
-            allocations.push_back(pair<void*, size_t> {malloc(sizeof(Order)*newsz), newsz});
-            currIdx = 0;
-            p = allocations.back();
-        }
-        return (void*)((Order*)(p.first) + (currIdx++));
+    // bad input is reported on the input thread. in async mode an output thread owns cout: cerr waits for it.
+    // with a journal, output is held until its journal group is committed: cerr commits it first
+    MatchEngine* pengine = nullptr;
+    FlushHook flushHook([&pengine]() {
+        if(pengine) {
+            pengine->flushOutput();
+        }
+    });
+    ostream flushOutput(&flushHook);
+    ofstream depthOut;  // declared before the engine, which writes to it until destroyed
+    MatchEngine engine(is, std::cout, poolOpts, pubMode, pubFormat);
+    pengine = &engine;
+    // untied again on every way out of main, before the engine and the hook are destroyed
+    ScopedTie cerrTie(std::cerr, pubMode == TradePublisher::Mode::ASYNC || journalFile ? &flushOutput : &std::cout);
+    if(depthFile) {
+        depthOut.open(depthFile);
+        if(!depthOut) {
+            std::cerr << "Cannot open " << depthFile << std::endl;
+            return -1;
+        }
+        engine.enableDepthFeed(depthOut, topLevels, chrono::milliseconds(topInterval));
     }
-    
-private:
-    size_t currIdx;
-    vector<pair<void*, size_t>> allocations;    
-};
-
-
-class MatchEngine {
-public:
-
-    MatchEngine(istream& is_=std::cin, ostream& os_=std::cout): is(is_), os(os_), ordpool(256) {}
-
-    bool processInputLine(const string& msg) {
-        // parse the msg first then process them
-        vector<string> inputFields;
-        size_t pos = 0;
-        size_t start = 0;
-        while((pos=msg.find(' ', start)) != string::npos) {
-            inputFields.push_back(msg.substr(start, pos-start));
-            start = pos + 1;
-        }
-        inputFields.push_back(msg.substr(start));
-        auto mtype = getMessageType(inputFields[0]);
-        switch(mtype) {
-            case MessageType::NEW:
-                {
-                    if(inputFields.size() != 6) {
-                        std::cerr << "Bad input for new order: " << msg<< " Ignored.\n";
-                        return false;
-                    }
-                    auto oside = getOrderSide(inputFields[1]);
-                    auto otype = getOrderType(inputFields[2]);
-                    long price = stol(inputFields[3]);
-                    int qty = stoi(inputFields[4]);
-                    if(price <=0 || qty <=0 || inputFields[5].empty()) {
-                        return false; //bailout if price/qty/orderId is invalid
-                    }
-                    if(oside == OrderSide::BUY) {
-                        processBuyOrder(inputFields[5], otype, price, qty);
-                    }
-                    else if(oside == OrderSide::SELL) {
-                        processSellOrder(inputFields[5], otype, price, qty);
-                    }
-                }
-                break;
-            case MessageType::CANCEL:
-                {
-                    if(inputFields.size() != 2) {
-                        std::cerr << "Bad input for Cancel Order: " << msg << " Ignored.\n";
-                        return false;
-                    }
-                    cancelOrder(inputFields[1]);
-                }
-                break;
-            case MessageType::MODIFY:
-                {
-                    if(inputFields.size() != 5) {
-                        std::cerr << "Bad input for Modify Order: " << msg << " Ignored.\n";
-                        return false;     
-                    }
-                    auto side = getOrderSide(inputFields[2]);
-                    auto price = stol(inputFields[3]);
-                    auto qty = stoi(inputFields[4]);
-                    if(price <=0 || qty <=0 || inputFields[1].empty()) {
-                        return false;
-                    }    
-                    modifyOrder(inputFields[1], side, price, qty);
-                }
-                break;
-            case MessageType::PRINT:
-                {
-                    if(inputFields.size() != 1) {
-                        std::cerr << "Bad input for PRINT: " << msg << " Ignored.\n";
-                        return false;     
-                    }
-                    printBook();
-                }
-                break;
-            default:
-                return false;
-        }       
-        return true;
-    } 
-    
-    void printBook() {
-        os << "SELL:\n";
-        sellBook.printBook(os);
-        os << "BUY:\n";
-        buyBook.printBook(os);
+    if(tradeStats) {
+        engine.enableTradeStats(*tradeStats, statsSymbol);
     }
-    
-    void run() {
-        std::string input;
-        while(getline(is, input)) {
-            processInputLine(input);
+    if(journalFile) {
+        string snapshot = snapshotFile ? snapshotFile : "";
+        if(recover) {
+            auto replayed = engine.recover(snapshot, journalFile);
+            std::cerr << "Recovered, " << replayed << " journal messages replayed\n";
         }
+        engine.enableJournal(journalFile, journalOpts, snapshot, snapshotEvery);
     }
-    
-private:
-    istream& is;
-    ostream& os;
-    OrderMemoryPool ordpool;    
-    OrderBook buyBook;
-    OrderBook sellBook;
-    unordered_map<string, Order*> orderMap;
-    
-    template<OrderSide side> 
-    bool processNewOrder(Order* porder) {
-        auto matchBook = [this]() -> auto& {
-            if constexpr (side == OrderSide::BUY) {
-                return sellBook;
-            }
-            if constexpr (side == OrderSide::SELL) {
-                return buyBook;
-            }
-        };
-        auto resBook = [this]() -> auto& {
-            if constexpr (side == OrderSide::BUY) {
-                return buyBook;
-            }
-            if constexpr (side == OrderSide::SELL) {
-                return sellBook;
-            }
-        };
-        vector<TradeDetail> trades;
-        auto ret = matchBook().tryMatchOrder(*porder, trades);
-        if(ret.first) { // match happened
-            for(auto& trade: trades) {
-                printTrade(os, trade);
-            }
+    if(binary && inputFile) {
+        MappedFile file(inputFile);
+        if(file.size() % sizeof(BinaryMessage)) {
+            std::cerr << "Truncated binary message at end of input. Ignored.\n";
         }
-        if(porder->leaves > 0 && porder->type == OrderType::GFD) { // only GFD order goes to the the orderbook
-            auto it = resBook().addOrder(porder);
+        if(batch > 1) {
+            engine.runBinaryBatched((const BinaryMessage*)file.data(), file.size() / sizeof(BinaryMessage), batch);
         }
         else {
-            porder->doneFlag = true;
+            engine.runBinary((const BinaryMessage*)file.data(), file.size() / sizeof(BinaryMessage));
         }
-        return true;
-        
     }
-    
-    bool processBuyOrder(const std::string& orderId, OrderType otype, unsigned long price, int qty){
-        if(orderMap.count(orderId)) { //already exists
-            return false;
-        }
-        Order* porder = new(ordpool.getNext()) Order{OrderSide::BUY, otype, price, qty, qty, orderId, false};
-        orderMap[orderId] = porder; //Any order passed validation check has a place in the map
-        return processNewOrder<OrderSide::BUY>(porder);
-    }        
-
-    bool processSellOrder(const std::string& orderId, OrderType otype, unsigned long price, int qty) {
-        if(orderMap.count(orderId)) {
-            return false;
-        }
-        Order* porder = new(ordpool.getNext()) Order{OrderSide::SELL, otype, price, qty, qty, orderId, false};
-        orderMap[orderId] = porder;
-        return processNewOrder<OrderSide::SELL>(porder);
+    else if(binary && batch > 1) {
+        engine.runBinaryBatched(batch);
     }
-
-    bool modifyOrder(const std::string& orderId, OrderSide side, unsigned long price, int qty) {
-        //find the order, delete it and add the new order
-        //new order has to be on the same side of the old order
-        //if new order qty is less than or equal to filled qty. new order will not be created
-        //if qty is smaller while price no change, it does not change the order priority
-        auto it = orderMap.find(orderId);
-        if(it == orderMap.end() || it->second->doneFlag || it->second->side != side) { //either order not exist or order is done already or side changed, do nothing
-            return false;
-        }
-        
-        // mark the old order as Done
-        auto fillQty = it->second->quantity - it->second->leaves;
-        if(fillQty < qty && qty <= it->second->quantity && it->second->price == price) {
-            auto delta = it->second->quantity - qty;
-            it->second->quantity = qty;
-            it->second->leaves = qty - fillQty;
-            // update level
-            if(side == OrderSide::BUY) {
-                buyBook.reduceOrder(it->second, delta); 
-            }
-            else {
-                sellBook.reduceOrder(it->second, delta);
-            }
-            return true;
-        }
-
-        it->second->doneFlag = true;
-        if(it->second->side == OrderSide::BUY) {
-            buyBook.cancelOrder(it->second);
-        }
-        else {
-            sellBook.cancelOrder(it->second);
-        }
-        
-        if(fillQty >= qty ) {
-            return false;
-        }
-
-        Order* porder = new(ordpool.getNext()) Order(*(it->second));
-
-        // adding new order into map:
-        orderMap[orderId] = porder;
-        
-        // set the attributes of the new order
-        porder->quantity = qty;
-        porder->price = price;
-        porder->leaves = qty - fillQty;
-        porder->doneFlag = false;
-        
-        if(side == OrderSide::BUY) {
-            return processNewOrder<OrderSide::BUY>(porder);
-        }
-        else {
-            return processNewOrder<OrderSide::SELL>(porder);
-        }
-        return false;   
+    else if(binary) {
+        engine.runBinary();
     }
-    bool cancelOrder(const std::string& orderId) {
-        // return true if no error happens
-        auto it = orderMap.find(orderId);
-        if(it == orderMap.end() || it->second->doneFlag) { // order not found or already done
-            return false;
-        }
-        it->second->doneFlag = true;
-        if(it->second->side == OrderSide::BUY) {
-            buyBook.cancelOrder(it->second);
-        }
-        else {
-            sellBook.cancelOrder(it->second);
-        }
-        return true;        
-    } 
-};
-
-int main() {
-    /* Read input from STDIN. Print output to STDOUT */
-    MatchEngine engine;
-    engine.run();
+    else if(batch > 1) {
+        engine.runBatched(batch);
+    }
+    else {
+        engine.run();
+    }
+    if(latencyStatsEnabled) {
+        engine.dumpLatency(std::cerr);
+    }
+    writeTradeStats();
     return 0;
 }
-
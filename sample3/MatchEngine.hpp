@@ -0,0 +1,2318 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cassert>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <cstdint>
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <limits>
+
+#include "../sample1/CircularQueue.hpp"
+#include "Doorbell.hpp"
+#include "LatencyStats.hpp"
+#include "Journal.hpp"
+#include "TopOfBook.hpp"
+#include "TradeStatFeed.hpp"
+
+using namespace std;
+
+struct Order;
+class PriceLevel;
+struct OrderOwner;
+
+enum class OrderSide {
+    BUY,
+    SELL,
+    UNKNOWN
+};
+
+inline OrderSide getOrderSide(string_view sstr) {
+    if(sstr == "BUY") {
+        return OrderSide::BUY;
+    }
+    else if(sstr == "SELL") {
+        return OrderSide::SELL;
+    }
+    return OrderSide::UNKNOWN;
+}
+
+enum class OrderType {
+    IOC,
+    GFD,
+    MKT,
+    UNKNOWN
+};
+
+inline OrderType getOrderType(string_view otstr) {
+    if(otstr == "IOC") {
+        return OrderType::IOC;
+    }
+    else if(otstr == "GFD") {
+        return OrderType::GFD;
+    }
+    return OrderType::UNKNOWN;
+}
+
+enum class MessageType {
+    NEW,
+    CANCEL,
+    MODIFY,
+    PRINT,
+    MASSCANCEL,
+    UNKNOWN
+};
+
+inline MessageType getMessageType(string_view tstr) {
+        if(tstr == "NEW") {
+            return MessageType::NEW;
+        }
+        else if (tstr == "CANCEL") {
+            return MessageType::CANCEL;
+        }
+        else if (tstr == "MODIFY") {
+            return MessageType::MODIFY;
+        }
+        else if (tstr == "PRINT") {
+            return MessageType::PRINT;
+        }        
+        else if (tstr == "MASSCANCEL") {
+            return MessageType::MASSCANCEL;
+        }
+        return MessageType::UNKNOWN;
+}
+
+// MessageFields splits an input line on single spaces into string_views over the line itself.
+// Like the former vector<string> split, consecutive spaces give empty fields and every field is counted,
+// only the first maxFields are kept (no message uses more).
+struct MessageFields {
+    static constexpr size_t maxFields = 8;
+    string_view fields[maxFields];
+    size_t count = 0;
+
+    explicit MessageFields(string_view msg) {
+        size_t start = 0;
+        size_t pos;
+        while((pos=msg.find(' ', start)) != string_view::npos) {
+            add(msg.substr(start, pos-start));
+            start = pos + 1;
+        }
+        add(msg.substr(start));
+    }
+    size_t size() const { return count; }
+    string_view operator[](size_t i) const { return fields[i]; }
+
+private:
+    void add(string_view f) {
+        if(count < maxFields) {
+            fields[count] = f;
+        }
+        ++count;
+    }
+};
+
+// parse a leading integer the way stol/stoi accept it (leading blanks, optional sign, trailing text ignored)
+// returns false if there is no number or it does not fit in T
+template<typename T>
+inline bool parseNumber(string_view sv, T& value) {
+    size_t i = 0;
+    while(i < sv.size() && isspace((unsigned char)sv[i])) {
+        ++i;
+    }
+    if(i < sv.size() && sv[i] == '+') {
+        ++i;
+        if(i < sv.size() && sv[i] == '-') {
+            return false;
+        }
+    }
+    auto [ptr, ec] = from_chars(sv.data() + i, sv.data() + sv.size(), value);
+    return ec == errc();
+}
+
+// OrderMessage is a decoded input message, whichever wire format (text or binary) it came from.
+// orderId and owner point into the input buffer and are only valid while the message is processed.
+// MASSCANCEL: side UNKNOWN for both sides, price to maxPrice is the price range
+struct OrderMessage {
+    MessageType type;
+    OrderSide side;
+    OrderType orderType;
+    long price;
+    int qty;
+    string_view orderId;
+    string_view owner;       // optional owner (participant, session) of a NEW order, owner to MASSCANCEL
+    long maxPrice;
+};
+
+// decode one text message. prints the Bad input message (unless report is false) and returns false if the
+// message has to be ignored. price/qty/orderId values are checked when the message is processed, the same
+// way for every format
+inline bool parseInputLine(string_view msg, OrderMessage& m, bool report = true) {
+    auto bad = [msg, report](const char* what) {
+        if(report) {
+            std::cerr << "Bad input for " << what << ": " << msg << " Ignored.\n";
+        }
+        return false;
+    };
+    MessageFields inputFields(msg);
+    m = OrderMessage{getMessageType(inputFields[0]), OrderSide::UNKNOWN, OrderType::UNKNOWN, 0, 0, string_view()};
+    switch(m.type) {
+        case MessageType::NEW:
+            if(inputFields.size() != 6 && inputFields.size() != 7) {
+                return bad("new order");
+            }
+            if(inputFields.size() == 7) {
+                // a stray blank in a 6 field line also gives 7 fields, one of them empty: still bad input
+                for(size_t i=1; i<7; ++i) {
+                    if(inputFields[i].empty()) {
+                        return bad("new order");
+                    }
+                }
+            }
+            m.side = getOrderSide(inputFields[1]);
+            m.orderType = getOrderType(inputFields[2]);
+            m.orderId = inputFields[5];
+            if(inputFields.size() == 7) {
+                m.owner = inputFields[6];
+            }
+            return parseNumber(inputFields[3], m.price) && parseNumber(inputFields[4], m.qty);
+        case MessageType::CANCEL:
+            if(inputFields.size() != 2) {
+                return bad("Cancel Order");
+            }
+            m.orderId = inputFields[1];
+            return true;
+        case MessageType::MODIFY:
+            if(inputFields.size() != 5) {
+                return bad("Modify Order");
+            }
+            m.orderId = inputFields[1];
+            m.side = getOrderSide(inputFields[2]);
+            return parseNumber(inputFields[3], m.price) && parseNumber(inputFields[4], m.qty);
+        case MessageType::PRINT:
+            if(inputFields.size() != 1) {
+                return bad("PRINT");
+            }
+            return true;
+        case MessageType::MASSCANCEL:
+            {
+                // MASSCANCEL owner [side] [minPrice maxPrice]
+                size_t n = inputFields.size();
+                size_t next = 2;
+                bool ok = n >= 2 && n <= 5;
+                if(ok) {
+                    m.owner = inputFields[1];
+                    m.maxPrice = numeric_limits<long>::max();
+                    if(n == 3 || n == 5) {
+                        m.side = getOrderSide(inputFields[next++]);
+                        ok = m.side != OrderSide::UNKNOWN;
+                    }
+                    if(n >= 4) {
+                        ok = ok && parseNumber(inputFields[next], m.price) && parseNumber(inputFields[next + 1], m.maxPrice);
+                    }
+                }
+                return ok || bad("Mass Cancel");
+            }
+        default:
+            return false;
+    }
+}
+
+// BinaryMessage is the fixed layout binary order-entry record. 64 bytes, no padding, native (little endian)
+// byte order. enum fields hold the value of the matching enum class. symbol and orderId are zero padded,
+// not null terminated. symbol is only used by the multi-symbol engine.
+struct BinaryMessage {
+    uint8_t type;       // MessageType
+    uint8_t side;       // OrderSide
+    uint8_t orderType;  // OrderType
+    uint8_t idLen;      // bytes used in orderId
+    int32_t qty;
+    int64_t price;
+    char symbol[8];
+    char orderId[40];
+};
+static_assert(sizeof(BinaryMessage) == 64, "BinaryMessage must stay one cache line without padding");
+
+// returns false if the message can not be represented (symbol or order id longer than the record allows)
+// owners and MASSCANCEL are text only
+inline bool encodeMessage(const OrderMessage& m, BinaryMessage& bm, string_view symbol = string_view()) {
+    if(m.orderId.size() > sizeof(bm.orderId) || symbol.size() > sizeof(bm.symbol)
+       || !m.owner.empty() || m.type == MessageType::MASSCANCEL) {
+        return false;
+    }
+    bm = BinaryMessage{uint8_t(m.type), uint8_t(m.side), uint8_t(m.orderType), uint8_t(m.orderId.size()),
+                       int32_t(m.qty), int64_t(m.price), {}, {}};
+    // an empty string_view may have a null data(), which memcpy does not take even for 0 bytes
+    if(!symbol.empty()) {
+        memcpy(bm.symbol, symbol.data(), symbol.size());
+    }
+    if(!m.orderId.empty()) {
+        memcpy(bm.orderId, m.orderId.data(), m.orderId.size());
+    }
+    return true;
+}
+
+inline string_view symbolOf(const BinaryMessage& bm) {
+    return string_view(bm.symbol, strnlen(bm.symbol, sizeof(bm.symbol)));
+}
+
+// multi-symbol text messages start with the symbol: "<symbol> <message>".
+// returns false if there is no symbol field
+inline bool splitSymbol(string_view line, string_view& symbol, string_view& msg) {
+    auto pos = line.find(' ');
+    if(pos == string_view::npos || pos == 0) {
+        return false;
+    }
+    symbol = line.substr(0, pos);
+    msg = line.substr(pos + 1);
+    return true;
+}
+
+// the returned message refers to the id bytes inside bm. returns false for a corrupt record
+inline bool decodeMessage(const BinaryMessage& bm, OrderMessage& m) {
+    if(bm.type >= uint8_t(MessageType::MASSCANCEL) || bm.idLen > sizeof(bm.orderId)) {
+        return false;
+    }
+    m = OrderMessage{MessageType(bm.type),
+                     bm.side < uint8_t(OrderSide::UNKNOWN) ? OrderSide(bm.side) : OrderSide::UNKNOWN,
+                     bm.orderType < uint8_t(OrderType::UNKNOWN) ? OrderType(bm.orderType) : OrderType::UNKNOWN,
+                     long(bm.price), int(bm.qty), string_view(bm.orderId, bm.idLen)};
+    return true;
+}
+
+struct NoIdle {
+    void operator()() const {}
+};
+
+// read up to len bytes of what the stream has now. waits only while nothing at all is available, so input
+// from a live pipe is processed as it arrives instead of when a whole block is there. 0 at the end of input.
+// idle() is called before it waits
+template<typename Idle = NoIdle>
+inline size_t readAvailable(istream& is, char* dst, size_t len, Idle&& idle = Idle()) {
+    auto sb = is.rdbuf();
+    if(sb->in_avail() <= 0) {
+        idle();
+        if(auto tied = is.tie()) { // about to wait for input: flush the tied output, as istream does
+            tied->flush();
+        }
+        if(sb->sgetc() == char_traits<char>::eof()) {
+            return 0;
+        }
+    }
+    size_t got = 0;
+    streamsize avail;
+    while(got < len && (avail = sb->in_avail()) > 0) {
+        got += sb->sgetn(dst + got, min<streamsize>(avail, len - got));
+    }
+    if(got == 0) { // a stream buffer that can not tell what is available (stdio synchronized cin)
+        got = sb->sgetn(dst, 1);
+    }
+    return got;
+}
+
+// read in blocks of up to blockSize and call f with every line (without the newline), in place in the read
+// buffer. a line cut by the end of a read is moved to the front of the buffer and completed by the next read.
+// idle() is called when the input runs dry, before waiting for more
+template<typename F, typename Idle = NoIdle>
+void forEachLine(istream& is, F&& f, size_t blockSize = 1 << 20, Idle&& idle = Idle()) {
+    vector<char> buf(blockSize);
+    size_t filled = 0;
+    while(true) {
+        if(filled == buf.size()) { // a single line longer than the buffer
+            buf.resize(buf.size() * 2);
+        }
+        auto n = readAvailable(is, buf.data() + filled, buf.size() - filled, idle);
+        if(n == 0) {
+            break;
+        }
+        filled += n;
+        const char* p = buf.data();
+        const char* end = buf.data() + filled;
+        while(auto nl = (const char*)memchr(p, '\n', end - p)) {
+            f(string_view(p, nl - p));
+            p = nl + 1;
+        }
+        filled = end - p;
+        memmove(buf.data(), p, filled);
+    }
+    if(filled > 0) { // last line without a newline
+        f(string_view(buf.data(), filled));
+    }
+}
+
+// like forEachLine, but f gets up to batchSize lines at a time (f(const string_view* lines, size_t n)).
+// a batch never spans two reads, the lines are in place in the read buffer
+template<typename F, typename Idle = NoIdle>
+void forEachLineBatch(istream& is, size_t batchSize, F&& f, size_t blockSize = 1 << 20, Idle&& idle = Idle()) {
+    vector<char> buf(blockSize);
+    vector<string_view> lines;
+    lines.reserve(batchSize);
+    size_t filled = 0;
+    auto flushLines = [&lines, &f]() {
+        if(!lines.empty()) {
+            f(lines.data(), lines.size());
+            lines.clear();
+        }
+    };
+    while(true) {
+        if(filled == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+        auto n = readAvailable(is, buf.data() + filled, buf.size() - filled, idle);
+        if(n == 0) {
+            break;
+        }
+        filled += n;
+        const char* p = buf.data();
+        const char* end = buf.data() + filled;
+        while(auto nl = (const char*)memchr(p, '\n', end - p)) {
+            lines.emplace_back(p, nl - p);
+            if(lines.size() == batchSize) {
+                flushLines();
+            }
+            p = nl + 1;
+        }
+        flushLines();  // before the buffer is compacted
+        filled = end - p;
+        memmove(buf.data(), p, filled);
+    }
+    if(filled > 0) {
+        lines.emplace_back(buf.data(), filled);
+        flushLines();
+    }
+}
+
+// convert text messages to BinaryMessage records. messages the engine would ignore are dropped.
+// with withSymbol every line starts with the symbol of the message
+inline void convertTextToBinary(istream& is, ostream& os, bool withSymbol = false) {
+    forEachLine(is, [&os, withSymbol](string_view line) {
+        OrderMessage m;
+        BinaryMessage bm;
+        string_view symbol;
+        string_view msg = line;
+        if(withSymbol && !splitSymbol(line, symbol, msg)) {
+            std::cerr << "Bad input, no symbol: " << line << " Ignored.\n";
+            return;
+        }
+        if(parseInputLine(msg, m)) {
+            if(encodeMessage(m, bm, symbol)) {
+                os.write((const char*)&bm, sizeof(bm));
+            }
+            else {
+                std::cerr << "Symbol or order id too long, or text only message: " << line << " Ignored.\n";
+            }
+        }
+    });
+}
+
+// OrderId is a handle to an interned order id.
+// The id text is copied once into an OrderIdArena and never moves, so the handle can be copied around
+// (Order, TradeDetail) without touching the heap. Two handles of the same table are equal iff data is equal.
+struct OrderId {
+    const char* data;
+    uint32_t len;
+    uint32_t hash;
+    string_view view() const { return string_view(data, len); }
+};
+
+inline ostream& operator<< (ostream& os, const OrderId& id) {
+    return os << id.view();
+}
+
+inline uint32_t hashOrderId(string_view id) {
+    // word at a time multiply-xorshift hash. order ids are short, so this is a handful of instructions
+    constexpr uint64_t m = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = id.size() * m;
+    size_t i = 0;
+    for(; i + 8 <= id.size(); i += 8) {
+        uint64_t w;
+        memcpy(&w, id.data() + i, 8);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
+    }
+    if(i < id.size()) {
+        uint64_t w = 0;
+        memcpy(&w, id.data() + i, id.size() - i);
+        h = (h ^ w) * m;
+        h ^= h >> 29;
+    }
+    h *= m;
+    return uint32_t(h >> 32);
+}
+
+// OrderIdArena keeps interned id text in fixed size chunks. Chunks are never reallocated, so the
+// pointers held by OrderId stay valid for the life of the arena.
+class OrderIdArena {
+public:
+    const char* store(string_view id) {
+        if(id.size() > chunkSize - used) {
+            chunks.emplace_back(new char[max(chunkSize, id.size())]);
+            used = 0;
+        }
+        char* p = chunks.back().get() + used;
+        memcpy(p, id.data(), id.size());
+        used += id.size();
+        return p;
+    }
+
+private:
+    static constexpr size_t chunkSize = 64 * 1024;
+    size_t used = chunkSize;
+    vector<unique_ptr<char[]>> chunks;
+};
+
+// OrderIdIndex maps an order id to the live Order. It is a linear probing open addressing table with
+// the id hash cached in the slot, so a probe only touches the id text when the hashes match.
+// Deletion uses backward shifting instead of tombstones, so probe lengths do not decay over the day.
+// An entry whose order is done keeps its key with a nullptr order: the id can not be used again.
+class OrderIdIndex {
+public:
+    struct Entry {
+        OrderId id;     // id.data == nullptr marks an empty slot
+        Order* order;
+    };
+
+    OrderIdIndex(size_t capacity = 1024) : count{0} {
+        size_t cap = 16;
+        while(cap < capacity * 2) {
+            cap <<= 1;
+        }
+        slots.assign(cap, Entry{OrderId{nullptr, 0, 0}, nullptr});
+        mask = cap - 1;
+    }
+
+    Entry* find(string_view id) {
+        return findHashed(id, hashOrderId(id));
+    }
+
+    // insert id if it is not in the index yet. the bool is false if the id was already there
+    pair<Entry*, bool> tryEmplace(string_view id) {
+        auto hash = hashOrderId(id);
+        if(auto pe = findHashed(id, hash)) {
+            return {pe, false};
+        }
+        if((count + 1) * 2 > slots.size()) {  // keep the load factor at or below 1/2
+            grow();
+        }
+        size_t i = hash & mask;
+        while(slots[i].id.data) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = Entry{OrderId{arena.store(id), uint32_t(id.size()), hash}, nullptr};
+        ++count;
+        return {&slots[i], true};
+    }
+
+    // the order is done: drop the pointer but keep the key. no-op if the id already refers to another order
+    void retire(const Order* porder, const OrderId& id) {
+        for(size_t i = id.hash & mask; slots[i].id.data; i = (i + 1) & mask) {
+            if(slots[i].id.data == id.data) {
+                if(slots[i].order == porder) {
+                    slots[i].order = nullptr;
+                }
+                return;
+            }
+        }
+    }
+
+    bool erase(string_view id) {
+        auto pe = find(id);
+        if(!pe) {
+            return false;
+        }
+        // backward shift: pull every following entry of the cluster that may live in the hole
+        size_t hole = pe - slots.data();
+        for(size_t i = (hole + 1) & mask; slots[i].id.data; i = (i + 1) & mask) {
+            size_t home = slots[i].id.hash & mask;
+            if(((i - home) & mask) >= ((i - hole) & mask)) {
+                slots[hole] = slots[i];
+                hole = i;
+            }
+        }
+        slots[hole] = Entry{OrderId{nullptr, 0, 0}, nullptr};
+        --count;
+        return true;
+    }
+
+    size_t size() const { return count; }
+
+    // batch lookahead (MatchEngine::processBatch): start loading the home slot of an id hash
+    void prefetch(uint32_t hash) const {
+        __builtin_prefetch(&slots[hash & mask]);
+    }
+
+    // the entry an id with this hash most likely is, without comparing the id text. a hint only
+    const Entry* candidate(uint32_t hash) const {
+        for(size_t i = hash & mask; slots[i].id.data; i = (i + 1) & mask) {
+            if(slots[i].id.hash == hash) {
+                return &slots[i];
+            }
+        }
+        return nullptr;
+    }
+
+    template<typename F>
+    void forEach(F&& f) const {
+        for(auto& e: slots) {
+            if(e.id.data) {
+                f(e);
+            }
+        }
+    }
+
+private:
+    vector<Entry> slots;
+    size_t mask;
+    size_t count;
+    OrderIdArena arena;
+
+    Entry* findHashed(string_view id, uint32_t hash) {
+        for(size_t i = hash & mask; slots[i].id.data; i = (i + 1) & mask) {
+            auto& e = slots[i];
+            if(e.id.hash == hash && e.id.view() == id) {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+
+    void grow() {
+        vector<Entry> old(slots.size() * 2, Entry{OrderId{nullptr, 0, 0}, nullptr});
+        old.swap(slots);
+        mask = slots.size() - 1;
+        for(auto& e: old) {
+            if(e.id.data) {
+                size_t i = e.id.hash & mask;
+                while(slots[i].id.data) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = e;
+            }
+        }
+    }
+};
+
+struct Order {
+    OrderSide side;
+    OrderType type;
+    unsigned long price;
+    int quantity;   // the original order quantity, assigned when initialized
+    int leaves;     // leaves initialized with original quantity. will change when trade happens. 
+    OrderId orderId;
+    bool doneFlag;  // when doneFlag is true (set when order is canceled or fully filled), order is finished. and no further action
+    bool inBook;    // true while a PriceLevel order list still holds a pointer to this order
+    PriceLevel* level;  // the level holding the order while inBook. map nodes do not move
+    list<Order*>::iterator pos;  // the order's entry in level's order list while inBook
+    OrderOwner* owner;  // set while the order rests in the book and is linked in its owner's list
+    Order* ownerPrev;
+    Order* ownerNext;
+};
+
+// OrderOwner is a participant or session owning orders. Its resting orders of each side form an intrusive
+// doubly linked list through the orders, so MASSCANCEL finds them without an order id lookup, a one sided
+// MASSCANCEL does not walk the other side, and unlinking is O(1).
+struct OrderOwner {
+    string_view name;
+    Order* head[2] = {nullptr, nullptr};  // by OrderSide, BUY and SELL
+    size_t count = 0;
+};
+
+inline void linkOwner(Order* porder, OrderOwner* owner) {
+    auto& head = owner->head[size_t(porder->side)];
+    porder->owner = owner;
+    porder->ownerPrev = nullptr;
+    porder->ownerNext = head;
+    if(head) {
+        head->ownerPrev = porder;
+    }
+    head = porder;
+    ++owner->count;
+}
+
+// no-op for an order that is not linked
+inline void unlinkOwner(Order* porder) {
+    auto owner = porder->owner;
+    if(!owner) {
+        return;
+    }
+    if(porder->ownerPrev) {
+        porder->ownerPrev->ownerNext = porder->ownerNext;
+    }
+    else {
+        owner->head[size_t(porder->side)] = porder->ownerNext;
+    }
+    if(porder->ownerNext) {
+        porder->ownerNext->ownerPrev = porder->ownerPrev;
+    }
+    --owner->count;
+    porder->owner = nullptr;
+}
+
+// OrderOwnerIndex interns owner names. Owners are few and live for the whole day
+class OrderOwnerIndex {
+public:
+    OrderOwner* get(string_view name) {
+        auto it = owners.find(name);
+        if(it == owners.end()) {
+            string_view stored(names.store(name), name.size());
+            it = owners.emplace(stored, OrderOwner{stored}).first;
+        }
+        return &it->second;
+    }
+
+    OrderOwner* find(string_view name) {
+        auto it = owners.find(name);
+        return it == owners.end() ? nullptr : &it->second;
+    }
+
+private:
+    OrderIdArena names;
+    unordered_map<string_view, OrderOwner> owners;  // node based, an OrderOwner does not move
+};
+
+// OrderMemoryPool provides fixed size slots to hold Orders.
+// Memory is carved from fixed size slabs. A released slot goes onto an intrusive free-list and is handed out
+// again before any fresh slot is touched, so the footprint follows the number of live orders, not the message count.
+// An order is released once it is done and no PriceLevel holds it anymore (see Order::inBook).
+// Slabs can optionally be backed by huge pages and pre-faulted, so the hot path does not take page faults.
+class OrderMemoryPool {
+public:
+    struct Options {
+        size_t slabSize = 1024;   // number of orders per slab
+        size_t initialSlabs = 1;  // slabs mapped up front
+        bool hugePages = false;   // try MAP_HUGETLB first, fall back to madvise(MADV_HUGEPAGE)
+        bool prefault = false;    // populate the pages when a slab is mapped
+    };
+
+    OrderMemoryPool(size_t sz = 1024) : OrderMemoryPool(Options{sz}) {}
+
+    explicit OrderMemoryPool(const Options& opts_) : opts(opts_), freeList{nullptr}, currIdx{0}, live{0} {
+        static_assert(sizeof(Order) >= sizeof(FreeSlot), "an order slot must be able to hold a free-list link");
+        if(opts.slabSize == 0) {
+            opts.slabSize = 1;
+        }
+        if(opts.hugePages) { // a slab fills whole huge pages: the orders per slab follow from the mapped size
+            size_t bytes = (sizeof(Order) * opts.slabSize + hugePageSize - 1) / hugePageSize * hugePageSize;
+            opts.slabSize = bytes / sizeof(Order);
+        }
+        for(size_t i=0; i<std::max<size_t>(opts.initialSlabs, 1); ++i) {
+            addSlab();
+        }
+        currSlab = 0;
+    }
+
+    ~OrderMemoryPool() { // live orders are destroyed by their owners (OrderBook) before the pool goes away
+        for(auto [p, bytes]: slabs) {
+            munmap(p, bytes);
+        }
+    }
+
+    OrderMemoryPool(const OrderMemoryPool&) = delete;
+    OrderMemoryPool& operator=(const OrderMemoryPool&) = delete;
+
+    void* getNext() {
+        ++live;
+        if(freeList) {
+            auto p = freeList;
+            freeList = freeList->next;
+            return p;
+        }
+        if(currIdx == opts.slabSize) {  // current slab used out, move to the next one or map a new slab
+            if(++currSlab == slabs.size()) {
+                addSlab();
+            }
+            currIdx = 0;
+        }
+        return (void*)((Order*)(slabs[currSlab].first) + (currIdx++));
+    }
+
+    void release(Order* porder) {
+        assert(porder != nullptr && live > 0);
+        porder->~Order();
+        auto slot = new(porder) FreeSlot{freeList};
+        freeList = slot;
+        --live;
+    }
+
+    size_t liveCount() const { return live; }
+    size_t capacity() const { return slabs.size() * opts.slabSize; }
+
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+    static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+
+    Options opts;
+    FreeSlot* freeList;
+    size_t currSlab;
+    size_t currIdx;
+    size_t live;
+    vector<pair<void*, size_t>> slabs;  // mapped address and length in bytes
+
+    void addSlab() {
+        size_t bytes = sizeof(Order) * opts.slabSize;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void* p = MAP_FAILED;
+        if(opts.hugePages) {
+            size_t hbytes = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+            p = mmap(nullptr, hbytes, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | (opts.prefault ? MAP_POPULATE : 0), -1, 0);
+            if(p != MAP_FAILED) {
+                bytes = hbytes;
+            }
+        }
+        if(p == MAP_FAILED) {
+            size_t pageSize = sysconf(_SC_PAGESIZE);
+            bytes = (bytes + pageSize - 1) / pageSize * pageSize;
+            p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if(p == MAP_FAILED) {
+                throw bad_alloc();
+            }
+            if(opts.hugePages) { // no reserved huge pages, ask for transparent huge pages instead
+                madvise(p, bytes, MADV_HUGEPAGE);
+            }
+            if(opts.prefault) { // touch after madvise so the faults can already be served by huge pages
+                memset(p, 0, bytes);
+            }
+        }
+        slabs.push_back({p, bytes});
+    }
+};
+
+class TradeDetail {
+public:
+    TradeDetail(const OrderId& orderIdBook_, unsigned long priceBook_, const OrderId& orderIdComing_,
+                unsigned long priceComing_, int fillQty_) :
+               orderIdBook(orderIdBook_)
+               , priceBook(priceBook_)
+               , orderIdComing(orderIdComing_)
+               , priceComing(priceComing_)
+               , fillQty(fillQty_)
+               {}
+
+private:
+    OrderId orderIdBook;   // interned handles, no string copy per trade
+    unsigned long priceBook;
+    OrderId orderIdComing;
+    unsigned long priceComing;
+    int fillQty;
+
+friend class TradePublisher;
+friend class MatchEngine;
+
+};
+
+enum class DepthAction : uint8_t {
+    ADD,      // new price level
+    CHANGE,   // level quantity changed
+    DELETE    // level removed from the book
+};
+
+// DepthUpdate is one incremental L2 change. seq increases by one per update, per engine, across both sides
+struct DepthUpdate {
+    uint64_t seq;
+    OrderSide side;
+    DepthAction action;
+    unsigned long price;
+    int quantity;   // new level quantity, 0 for DELETE
+};
+
+inline string_view depthActionName(DepthAction a) {
+    return a == DepthAction::ADD ? "ADD" : a == DepthAction::CHANGE ? "CHANGE" : "DELETE";
+}
+
+// parse a "DEPTH seq side action price qty" line of the depth feed. false for any other line
+inline bool parseDepthLine(string_view line, DepthUpdate& u) {
+    MessageFields f(line);
+    if(f.size() != 6 || f[0] != "DEPTH") {
+        return false;
+    }
+    u.side = getOrderSide(f[2]);
+    u.action = f[3] == "ADD" ? DepthAction::ADD : f[3] == "CHANGE" ? DepthAction::CHANGE : DepthAction::DELETE;
+    return u.side != OrderSide::UNKNOWN && (u.action != DepthAction::DELETE || f[3] == "DELETE")
+           && parseNumber(f[1], u.seq) && parseNumber(f[4], u.price) && parseNumber(f[5], u.quantity);
+}
+
+// DepthFeed publishes the market data of one book: an incremental update every time a price level is added,
+// changed or deleted, and optionally a conflated top N snapshot of both sides at a fixed interval. The engine
+// has no timer: a due snapshot goes out with the next message, an idle book sends none (it has not changed).
+// Output is text, formatted into a buffer and handed to the stream in large writes:
+//     DEPTH <seq> <BUY|SELL> <ADD|CHANGE|DELETE> <price> <qty>
+//     TOP <seq> BUY <n> <price> <qty> ... SELL <n> <price> <qty> ...
+// a TOP line shows the book after update <seq>.
+// after hold() the buffer grows instead of being written out when full, release() writes what it holds.
+class DepthFeed {
+public:
+    DepthFeed(ostream& os_, size_t topLevels_=5, chrono::milliseconds interval_=chrono::milliseconds(0))
+    : os(os_), topLevels(topLevels_), interval(interval_), seq{0}, used{0}, buf(blockBytes),
+      nextSnapshot(chrono::steady_clock::now() + interval_) {}
+
+    ~DepthFeed() {
+        flush();
+    }
+
+    void update(OrderSide side, DepthAction action, unsigned long price, int quantity) {
+        reserve(96);
+        char* p = buf.data() + used;
+        memcpy(p, "DEPTH ", 6);
+        p = to_chars(p + 6, p + 32, ++seq).ptr;
+        p = putText(p, side == OrderSide::BUY ? " BUY " : " SELL ");
+        p = putText(p, depthActionName(action));
+        *p++ = ' ';
+        p = to_chars(p, p + 20, price).ptr;
+        *p++ = ' ';
+        p = to_chars(p, p + 12, action == DepthAction::DELETE ? 0 : quantity).ptr;
+        *p++ = '\n';
+        used = p - buf.data();
+    }
+
+    bool snapshotDue() const {
+        return interval.count() > 0 && chrono::steady_clock::now() >= nextSnapshot;
+    }
+
+    size_t levels() const { return topLevels; }
+
+    // best levels first, at most levels() per side
+    void snapshot(const vector<pair<unsigned long, int>>& bids, const vector<pair<unsigned long, int>>& asks) {
+        reserve(64 + (bids.size() + asks.size()) * 40);
+        char* p = buf.data() + used;
+        memcpy(p, "TOP ", 4);
+        p = to_chars(p + 4, p + 32, seq).ptr;
+        auto side = [&p](string_view name, const vector<pair<unsigned long, int>>& lv) {
+            p = putText(p, name);
+            p = to_chars(p, p + 20, lv.size()).ptr;
+            for(auto [price, qty]: lv) {
+                *p++ = ' ';
+                p = to_chars(p, p + 20, price).ptr;
+                *p++ = ' ';
+                p = to_chars(p, p + 12, qty).ptr;
+            }
+        };
+        side(" BUY ", bids);
+        side(" SELL ", asks);
+        *p++ = '\n';
+        used = p - buf.data();
+        nextSnapshot = chrono::steady_clock::now() + interval;
+    }
+
+    void flush() {
+        os.write(buf.data(), used);
+        os.flush();
+        used = 0;
+    }
+
+    void hold() { holding = true; }
+
+    void release() {
+        if(used >= blockBytes) {
+            os.write(buf.data(), used);
+            used = 0;
+        }
+    }
+
+private:
+    static constexpr size_t blockBytes = 64 * 1024;
+    ostream& os;
+    size_t topLevels;
+    chrono::milliseconds interval;
+    uint64_t seq;
+    size_t used;
+    vector<char> buf;
+    chrono::steady_clock::time_point nextSnapshot;
+    bool holding = false;
+
+    static char* putText(char* p, string_view sv) {
+        memcpy(p, sv.data(), sv.size());
+        return p + sv.size();
+    }
+
+    void reserve(size_t bytes) {
+        if(used + bytes > buf.size() && holding) {
+            buf.resize(max(buf.size() * 2, used + bytes));
+        }
+        if(used + bytes > buf.size()) {
+            os.write(buf.data(), used);
+            used = 0;
+            if(bytes > buf.size()) {
+                buf.resize(bytes);
+            }
+        }
+    }
+};
+
+// DepthBook rebuilds a price level book on the subscriber side from DepthUpdates.
+// Each update costs one map operation, independent of the depth of the book.
+class DepthBook {
+public:
+    // returns false if the update is out of sequence (an update was lost), the book is then stale
+    bool apply(const DepthUpdate& u) {
+        if(u.seq != lastSeq + 1) {
+            return false;
+        }
+        lastSeq = u.seq;
+        auto& side = u.side == OrderSide::BUY ? bids : asks;
+        if(u.action == DepthAction::DELETE) {
+            side.erase(u.price);
+        }
+        else {
+            side[u.price] = u.quantity;
+        }
+        return true;
+    }
+
+    uint64_t sequence() const { return lastSeq; }
+    const map<unsigned long, int>& buySide() const { return bids; }
+    const map<unsigned long, int>& sellSide() const { return asks; }
+
+private:
+    uint64_t lastSeq = 0;
+    map<unsigned long, int> bids;
+    map<unsigned long, int> asks;
+};
+
+class PriceLevel {
+public:
+    PriceLevel(unsigned long price_): price(price_), quantity(0), pendingCancel(0) {}
+    unsigned long getPrice() const {return price;}
+    int getQuantity() const { return quantity;}
+    
+    list<Order*>::iterator addOrder(Order* porder) { // add to the end of list and return the iterator
+        assert(porder != nullptr);
+        assert(porder->price == price);
+        orderList.push_back(porder);
+        quantity += porder->leaves;
+        porder->pos = --(orderList.end());
+        return porder->pos;
+    }
+
+    // take a canceled order out of the level and give its slot back, the level quantity is adjusted by the caller
+    void removeOrder(Order* porder, OrderMemoryPool& pool) {
+        orderList.erase(porder->pos);
+        porder->inBook = false;
+        pool.release(porder);
+    }
+    
+    int executeLevel(const OrderId& incomingOrderId, unsigned long price, int qty, vector<TradeDetail>& trades, OrderMemoryPool& pool, OrderIdIndex& ids) {
+        // the logic to decide whether to execute at this level is in OrderBook tryMatchOrder function
+        // filled orders leave the level and are given back to the pool. canceled orders are already gone
+        assert(qty >= 0 );
+        auto it = orderList.begin();
+        while(it!=orderList.end() && qty>0) {
+            auto& order = *(orderList.front());
+            assert(!order.doneFlag);
+            auto execQty = min (order.leaves, qty);
+            trades.push_back(TradeDetail{order.orderId, order.price, incomingOrderId, price, execQty});
+            quantity -= execQty;
+            qty -= execQty;
+            order.leaves -= execQty;
+            if(order.leaves == 0) {
+                order.doneFlag = true;
+                ids.retire(&order, order.orderId);
+                unlinkOwner(&order);
+                orderList.pop_front();
+                order.inBook = false;
+                pool.release(&order);
+            }
+            it = orderList.begin();
+        }
+        return qty;  // return leaves
+    } 
+
+    void releaseOrders(OrderMemoryPool& pool) { // called before the level is removed from the book
+        for(auto porder: orderList) {
+            porder->inBook = false;
+            pool.release(porder);
+        }
+        orderList.clear();
+    }
+
+private:
+    unsigned long price;
+    int quantity;
+    int pendingCancel;  // quantity of a mass cancel not applied yet (OrderBook::markCanceled)
+    list<Order*> orderList;
+
+friend class OrderBook;
+        
+};
+
+
+class OrderBook {
+    // only GFD order goes into an order book
+public:
+    OrderBook(OrderMemoryPool& pool_, OrderIdIndex& ids_) : pool(pool_), ids(ids_) {}
+
+    ~OrderBook() {
+        for(auto& [price, level]: levelMap) {
+            level.releaseOrders(pool);
+        }
+    }
+
+    void setDepthFeed(DepthFeed* depth_) { depth = depth_; }
+
+    list<Order*>::iterator addOrder(Order* porder) {
+        auto levels = levelMap.size();
+        PriceLevel& level = getLevelCreate(porder->price);
+        porder->inBook = true;
+        porder->level = &level;
+        auto it = level.addOrder(porder);
+        if(depth) {
+            depth->update(porder->side, levels == levelMap.size() ? DepthAction::CHANGE : DepthAction::ADD,
+                          level.price, level.quantity);
+        }
+        return it;
+    }
+    
+    // the order leaves its level at once and its slot goes back to the pool, porder is invalid afterwards
+    bool cancelOrder(Order* porder) {
+        auto plevel = porder->inBook ? porder->level : nullptr;
+        if(plevel) {
+            auto side = porder->side;
+            auto leaves = porder->leaves;
+            plevel->removeOrder(porder, pool);
+            reduceLevel(plevel, side, leaves);
+            return true;
+        }
+        return false;
+    }
+
+    // mass cancel: the order leaves its level like in cancelOrder, but its quantity is taken off the level
+    // by applyCanceled, once per level however many orders of the level are canceled
+    void markCanceled(Order* porder) {
+        auto plevel = porder->level;
+        if(plevel->pendingCancel == 0) {
+            canceledLevels.emplace_back(plevel, porder->side);
+        }
+        plevel->pendingCancel += porder->leaves;
+        plevel->removeOrder(porder, pool);
+    }
+
+    void applyCanceled() {
+        for(auto [plevel, side]: canceledLevels) {
+            auto qty = plevel->pendingCancel;
+            plevel->pendingCancel = 0;
+            reduceLevel(plevel, side, qty);
+        }
+        canceledLevels.clear();
+    }
+    
+    bool reduceOrder(Order* porder, int delta) {
+        assert(delta >= 0);
+        auto plevel = porder->inBook ? porder->level : nullptr;
+        if(plevel) {
+            plevel->quantity -= delta;
+            if(depth && delta > 0) {  // a modify to the same quantity changes nothing
+                depth->update(porder->side, DepthAction::CHANGE, plevel->price, plevel->quantity);
+            }
+            return true;
+        }
+        return false;
+    }
+ 
+    template<typename F>
+    void forEachLevel(F&& f) const {
+        // from higher price to lower price
+        for(auto it=levelMap.rbegin(); it!=levelMap.rend(); ++it) {
+            f(it->second.price, it->second.quantity);
+        }
+    }
+
+    // the n best levels of the book, best first. side is the side of the orders in this book
+    void topLevels(OrderSide side, size_t n, vector<pair<unsigned long, int>>& levels) const {
+        levels.clear();
+        forEachTopLevel(side, n, [&levels](unsigned long price, int qty) { levels.emplace_back(price, qty); });
+    }
+
+    // returns the number of levels stored, at most n
+    size_t topLevels(OrderSide side, size_t n, BookLevel* levels) const {
+        size_t count = 0;
+        forEachTopLevel(side, n, [&levels, &count](unsigned long price, int qty) {
+            levels[count++] = BookLevel{int64_t(price), qty};
+        });
+        return count;
+    }
+
+    template<typename F>
+    void forEachTopLevel(OrderSide side, size_t n, F&& f) const {
+        auto visit = [&f, n](auto first, auto last) {
+            for(size_t i=0; first != last && i < n; ++first, ++i) {
+                f(first->second.price, first->second.quantity);
+            }
+        };
+        if(side == OrderSide::BUY) {
+            visit(levelMap.rbegin(), levelMap.rend());
+        }
+        else {
+            visit(levelMap.begin(), levelMap.end());
+        }
+    }
+    // the orders in priority order: best level first, time order within a level
+    template<typename F>
+    void forEachOrder(OrderSide side, F&& f) const {
+        auto visit = [&f](auto first, auto last) {
+            for(; first != last; ++first) {
+                for(auto porder: first->second.orderList) {
+                    f(*porder);
+                }
+            }
+        };
+        if(side == OrderSide::BUY) {
+            visit(levelMap.rbegin(), levelMap.rend());
+        }
+        else {
+            visit(levelMap.begin(), levelMap.end());
+        }
+    }
+
+    pair<bool, int> tryMatchOrder(Order& order, vector<TradeDetail>& trades); //bool to indicate if match happened, and unsigned long the matched quantity
+    
+private:
+    OrderMemoryPool& pool;
+    OrderIdIndex& ids;
+    DepthFeed* depth = nullptr;  // market data of this book, optional
+    map<unsigned long, PriceLevel> levelMap;   // price to PriceLevel map. alternatively different data structure can be used 
+    vector<pair<PriceLevel*, OrderSide>> canceledLevels;  // levels with a pending mass cancel quantity
+
+    void reduceLevel(PriceLevel* plevel, OrderSide side, int qty) {
+        plevel->quantity -= qty;
+        if(depth) {
+            depth->update(side, plevel->quantity == 0 ? DepthAction::DELETE : DepthAction::CHANGE,
+                          plevel->price, plevel->quantity);
+        }
+        if(plevel->quantity == 0) {
+            auto price = plevel->price;
+            plevel->releaseOrders(pool);  // empty by now, every order of the level is done
+            levelMap.erase(price);
+        }
+    }
+    PriceLevel* getLevel(unsigned long price) {
+        auto it = levelMap.find(price);
+        if(it != levelMap.end()) {
+            return &(it->second); 
+        }
+        return nullptr;
+    }
+    PriceLevel& getLevelCreate(unsigned long price) { //if level for the price does not exist, create a new Pricelevel
+        auto plevel = getLevel(price);
+        if(plevel) {
+            return *plevel;
+        }
+        auto [it, flag] = levelMap.insert(make_pair(price, PriceLevel(price)));
+        if(! flag) { // insert fail. something really bad happened
+            throw runtime_error("LevelMap insert failure");
+        }
+        return it->second;
+    }
+    
+    PriceLevel* getTopOfBook(OrderSide side) {
+        if(!levelMap.empty()) {
+            return side==OrderSide::BUY ? &((--(levelMap.end()))->second) : &(levelMap.begin()->second);
+        }
+        return nullptr;
+    }
+    
+    void removeTopOfBook(OrderSide side) {
+        if(!levelMap.empty()) {
+            auto it = side == OrderSide::BUY ? --(levelMap.end()) : levelMap.begin();
+            it->second.releaseOrders(pool);
+            levelMap.erase(it);
+        }
+    }
+    
+    template<OrderSide side>
+    std::pair<bool, int> tryMatchOrderImpl(Order& order, vector<TradeDetail>& trades) {
+        auto levelPriceGoodForMatch = [] (PriceLevel* plevel, Order& order) { //side is the opposite of order side
+            if constexpr (side == OrderSide::SELL) {
+                return plevel->price <= order.price;
+            }
+            if constexpr (side == OrderSide::BUY) {
+                return plevel->price >= order.price;
+            }
+        };
+        auto plevel = getTopOfBook(side);
+        auto leaves = order.leaves;
+        while (leaves>0 && plevel && levelPriceGoodForMatch(plevel, order)) {
+            leaves = plevel->executeLevel(order.orderId, order.price, leaves, trades, pool, ids);
+            if(depth) { // one update per level, however many orders were filled in it
+                depth->update(side, plevel->quantity == 0 ? DepthAction::DELETE : DepthAction::CHANGE,
+                              plevel->price, plevel->quantity);
+            }
+            if(plevel->quantity == 0) {
+                removeTopOfBook(side);
+            }
+            if(leaves >0) {
+                plevel = getTopOfBook(side);
+            }
+        }
+        if(leaves == order.leaves) { // no fill happened
+            return {false, 0};
+        }
+        auto filled = order.leaves - leaves;
+        assert(filled > 0);
+        order.leaves = leaves;
+        return {true, filled};           
+    } 
+        
+};
+
+inline std::pair<bool, int> OrderBook::tryMatchOrder(Order& order, vector<TradeDetail>& trades) {
+    // The order is on the side of the book
+    switch(order.side) {
+        case OrderSide::BUY:
+            return tryMatchOrderImpl<OrderSide::SELL>(order, trades);
+        case OrderSide::SELL:
+            return tryMatchOrderImpl<OrderSide::BUY>(order, trades);
+        default:
+            break;
+    }
+    return {false, 0};
+}
+
+// TradePublisher is the output stage of the engine: trades and PRINT book dumps.
+// In ASYNC mode the match thread only stores compact binary events into a lock free ring. A writer thread
+// formats them in batches (to_chars into one buffer, one write per batch) or emits fixed size raw records,
+// so matching does not wait for formatting or I/O. The writer sleeps while the ring is empty (see Doorbell).
+// INLINE mode formats on the calling thread.
+// Events refer to interned order ids, the id arena must outlive the publisher.
+// hold() keeps published events back until release(), so the engine can keep output until the journal
+// records of the messages that caused it are on disk.
+class TradePublisher {
+public:
+    enum class Mode {
+        INLINE,
+        ASYNC
+    };
+    enum class Format {
+        TEXT,   // same text as the engine always printed
+        RAW     // TradeRecord per event
+    };
+
+    enum class EventType : uint8_t {
+        TRADE,
+        SELL_SIDE,
+        BUY_SIDE,
+        LEVEL,
+        STOP
+    };
+
+    // raw output record, native byte order. order ids are zero padded
+    struct TradeRecord {
+        uint8_t type;       // EventType
+        uint8_t pad[3];
+        int32_t qty;        // fill qty, or level qty
+        int64_t priceBook;  // trade price on the book, or level price
+        int64_t priceComing;
+        char orderIdBook[40];
+        char orderIdComing[40];
+    };
+
+    TradePublisher(ostream& os_, Mode mode_=Mode::INLINE, Format format_=Format::TEXT)
+    : os(os_), mode(mode_), format(format_), published{0}, written{0} {
+        if(mode == Mode::ASYNC) {
+            ring = make_unique<Ring>();
+            writer = std::thread([this]() { writeLoop(); });
+        }
+    }
+
+    ~TradePublisher() {
+        release();
+        if(writer.joinable()) {
+            releasable.store(numeric_limits<uint64_t>::max(), memory_order_release);  // let the STOP through
+            publish(Event{EventType::STOP, 0, 0, 0, OrderId{}, OrderId{}});
+            writer.join();
+        }
+    }
+
+    TradePublisher(const TradePublisher&) = delete;
+    TradePublisher& operator=(const TradePublisher&) = delete;
+
+    void trade(const TradeDetail& t) {
+        publish(Event{EventType::TRADE, t.fillQty, t.priceBook, t.priceComing, t.orderIdBook, t.orderIdComing});
+    }
+
+    void bookSide(OrderSide side) {  // start of one side of a PRINT
+        publish(Event{side == OrderSide::SELL ? EventType::SELL_SIDE : EventType::BUY_SIDE, 0, 0, 0, OrderId{}, OrderId{}});
+    }
+
+    void level(unsigned long price, int qty) {
+        publish(Event{EventType::LEVEL, qty, price, 0, OrderId{}, OrderId{}});
+    }
+
+    // wait until everything published (and released) so far is handed to the ostream
+    void flush() {
+        auto target = holding ? released : published;
+        if(mode == Mode::ASYNC) {
+            flushed.wait([this, target]() { return written.load(memory_order_acquire) == target; });
+        }
+        os.flush();
+    }
+
+    void hold() {
+        holding = true;
+        released = published;
+        releasable.store(released, memory_order_release);
+    }
+
+    // let everything published so far go out
+    void release() {
+        if(!holding || released == published) {
+            return;
+        }
+        released = published;
+        if(mode == Mode::INLINE) {
+            os.write(heldBuf.data(), heldBuf.size());
+            heldBuf.clear();
+            written.store(published, memory_order_relaxed);
+            return;
+        }
+        releasable.store(released, memory_order_release);
+        work.ring();
+    }
+
+private:
+    struct Event {
+        EventType type;
+        int qty;
+        unsigned long price;
+        unsigned long priceComing;
+        OrderId idBook;
+        OrderId idComing;
+    };
+
+    static constexpr size_t ringSize = 16384;
+    static constexpr size_t batchBytes = 64 * 1024;
+    using Ring = CircularQueue<Event, ringSize>;
+
+    ostream& os;
+    Mode mode;
+    Format format;
+    uint64_t published;             // match thread only
+    atomic<uint64_t> written;       // events handed to os by the writer
+    bool holding = false;
+    uint64_t released = 0;          // match thread only, with holding
+    atomic<uint64_t> releasable{numeric_limits<uint64_t>::max()};  // events the writer may hand to os
+    unique_ptr<Ring> ring;
+    std::thread writer;
+    Doorbell work;                  // the writer sleeps on it when there is nothing to write
+    Doorbell flushed;               // flush() sleeps on it until the writer got far enough
+    vector<char> inlineBuf;
+    vector<char> heldBuf;           // INLINE events not released yet
+
+    void publish(const Event& ev) {
+        ++published;
+        if(mode == Mode::INLINE) {
+            if(holding) {
+                auto used = heldBuf.size();
+                heldBuf.resize(used + maxEventBytes(ev));
+                heldBuf.resize(used + formatEvent(ev, heldBuf.data() + used));
+                return;
+            }
+            if(inlineBuf.size() < maxEventBytes(ev)) {
+                inlineBuf.resize(maxEventBytes(ev));
+            }
+            os.write(inlineBuf.data(), formatEvent(ev, inlineBuf.data()));
+            written.store(published, memory_order_relaxed);
+            return;
+        }
+        while(!ring->enQueue(ev)) { // writer is behind, the ring is full
+            std::this_thread::yield();
+        }
+        work.ring();
+    }
+
+    template<typename T>
+    static char* putNumber(char* p, T v) {
+        return to_chars(p, p + 20, v).ptr;
+    }
+
+    static char* putId(char* p, const OrderId& id) {
+        memcpy(p, id.data, id.len);
+        return p + id.len;
+    }
+
+    static void putRawId(char (&dst)[40], const OrderId& id) {
+        memset(dst, 0, sizeof(dst));
+        if(id.data) {
+            memcpy(dst, id.data, min<size_t>(id.len, sizeof(dst)));
+        }
+    }
+
+    // format one event into buf, returns the number of bytes. buf must hold maxEventBytes(ev)
+    size_t formatEvent(const Event& ev, char* buf) const {
+        if(format == Format::RAW) {
+            TradeRecord rec{uint8_t(ev.type), {}, ev.qty, int64_t(ev.price), int64_t(ev.priceComing), {}, {}};
+            putRawId(rec.orderIdBook, ev.idBook);
+            putRawId(rec.orderIdComing, ev.idComing);
+            memcpy(buf, &rec, sizeof(rec));
+            return sizeof(rec);
+        }
+        char* p = buf;
+        switch(ev.type) {
+            case EventType::TRADE:
+                memcpy(p, "TRADE ", 6);
+                p = putId(p + 6, ev.idBook);
+                *p++ = ' ';
+                p = putNumber(p, ev.price);
+                *p++ = ' ';
+                p = putNumber(p, ev.qty);
+                *p++ = ' ';
+                p = putId(p, ev.idComing);
+                *p++ = ' ';
+                p = putNumber(p, ev.priceComing);
+                break;
+            case EventType::SELL_SIDE:
+                memcpy(p, "SELL:", 5);
+                p += 5;
+                break;
+            case EventType::BUY_SIDE:
+                memcpy(p, "BUY:", 4);
+                p += 4;
+                break;
+            case EventType::LEVEL:
+                p = putNumber(p, ev.price);
+                *p++ = ' ';
+                p = putNumber(p, ev.qty);
+                break;
+            default:
+                return 0;
+        }
+        *p++ = '\n';
+        return p - buf;
+    }
+
+    size_t maxEventBytes(const Event& ev) const {
+        return sizeof(TradeRecord) + ev.idBook.len + ev.idComing.len + 64;
+    }
+
+    void writeLoop() {
+        vector<char> buf(batchBytes);
+        size_t used = 0;
+        uint64_t count = 0;
+        while(true) {
+            auto pev = ring->front();
+            if(pev && count >= releasable.load(memory_order_acquire)) { // held back, as if drained
+                pev = nullptr;
+            }
+            if(!pev) { // ring drained, hand the batch to the stream and let a live reader see it
+                if(used) {
+                    os.write(buf.data(), used);
+                    os.flush();
+                    used = 0;
+                    written.store(count, memory_order_release);
+                    flushed.ring();
+                }
+                work.wait([this, count]() {
+                    return ring->front() && count < releasable.load(memory_order_acquire);
+                });
+                continue;
+            }
+            if(pev->type == EventType::STOP) {
+                ring->popFront();
+                break;
+            }
+            if(used + maxEventBytes(*pev) > buf.size()) {
+                os.write(buf.data(), used);
+                used = 0;
+                written.store(count, memory_order_release);
+                flushed.ring();
+                if(maxEventBytes(*pev) > buf.size()) { // a very long order id
+                    buf.resize(maxEventBytes(*pev));
+                }
+            }
+            used += formatEvent(*pev, buf.data() + used);
+            ++count;
+            ring->popFront();
+        }
+        os.write(buf.data(), used);
+        os.flush();
+        written.store(count, memory_order_release);
+        flushed.ring();
+    }
+};
+
+// Journal and snapshot records, native byte order.
+// The journal is the accepted NEW, CANCEL, MODIFY and MASSCANCEL messages in processing order, each a
+// JournalRecord followed by idLen bytes of order id and ownerLen bytes of owner. A snapshot is a
+// SnapshotHeader, the live orders (SnapshotOrder, id and owner) buy side then sell side, each in priority
+// order, and the ids of done orders (uint32 length and id), which can not be used again. journalOffset is
+// the journal length covered by the snapshot: recovery loads the snapshot and replays the journal from there.
+struct JournalRecord {
+    uint8_t type;       // MessageType
+    uint8_t side;       // OrderSide
+    uint8_t orderType;  // OrderType
+    uint8_t reserved;
+    uint32_t idLen;
+    int64_t price;
+    int32_t qty;
+    uint32_t ownerLen;
+    int64_t maxPrice;   // MASSCANCEL price range
+};
+static_assert(sizeof(JournalRecord) == 32, "JournalRecord layout");
+
+struct SnapshotHeader {
+    char magic[8];      // "MESNAP2"
+    uint64_t journalOffset;
+    uint64_t buyOrders;
+    uint64_t sellOrders;
+    uint64_t doneIds;
+};
+
+struct SnapshotOrder {
+    int64_t price;
+    int32_t quantity;
+    int32_t leaves;
+    uint32_t idLen;
+    uint32_t ownerLen;
+};
+
+class MatchEngine {
+public:
+    static constexpr const char* messageTypeNames[] = {"NEW", "CANCEL", "MODIFY", "PRINT", "MASSCANCEL", "INVALID"};
+    using Latency = LatencyRecorder<size(messageTypeNames)>;  // per message type and stage
+
+    MatchEngine(istream& is_=std::cin, ostream& os_=std::cout, const OrderMemoryPool::Options& poolOpts=OrderMemoryPool::Options{256},
+                TradePublisher::Mode pubMode=TradePublisher::Mode::INLINE, TradePublisher::Format pubFormat=TradePublisher::Format::TEXT)
+    : is(is_), os(os_), ordpool(poolOpts), buyBook(ordpool, orderMap), sellBook(ordpool, orderMap), publisher(os_, pubMode, pubFormat),
+      ownLatency(make_unique<Latency>()), latency(ownLatency.get()) {
+        latency->setTypeNames(messageTypeNames);
+    }
+
+    bool processInputLine(string_view msg) {
+        // parse the msg first then process them
+        latency->start();
+        OrderMessage m;
+        bool ok = parseInputLine(msg, m);
+        latency->mark(LatencyStage::PARSE);
+        ok = ok && processMessage(m);
+        latency->finish(ok ? size_t(m.type) : size_t(MessageType::UNKNOWN));
+        return ok;
+    }
+
+    bool processBinaryMessage(const BinaryMessage& bm) {
+        latency->start();
+        OrderMessage m{MessageType::UNKNOWN, OrderSide::UNKNOWN, OrderType::UNKNOWN, 0, 0, string_view()};
+        bool ok = decodeMessage(bm, m);
+        latency->mark(LatencyStage::PARSE);
+        ok = ok && processMessage(m);
+        latency->finish(ok ? size_t(m.type) : size_t(MessageType::UNKNOWN));
+        return ok;
+    }
+
+    bool processMessage(const OrderMessage& m) {
+        if(depth && depth->snapshotDue()) { // conflated: the book as left by the previous message
+            publishTopLevels();
+        }
+        switch(m.type) {
+            case MessageType::NEW:
+                {
+                    if(m.price <=0 || m.qty <=0 || m.orderId.empty()) {
+                        return false; //bailout if price/qty/orderId is invalid
+                    }
+                    journalMessage(m);
+                    if(m.side == OrderSide::BUY) {
+                        processBuyOrder(m.orderId, m.orderType, m.price, m.qty, m.owner);
+                    }
+                    else if(m.side == OrderSide::SELL) {
+                        processSellOrder(m.orderId, m.orderType, m.price, m.qty, m.owner);
+                    }
+                }
+                break;
+            case MessageType::CANCEL:
+                journalMessage(m);
+                cancelOrder(m.orderId);
+                break;
+            case MessageType::MODIFY:
+                {
+                    if(m.price <=0 || m.qty <=0 || m.orderId.empty()) {
+                        return false;
+                    }    
+                    journalMessage(m);
+                    modifyOrder(m.orderId, m.side, m.price, m.qty);
+                }
+                break;
+            case MessageType::PRINT:
+                printBook();
+                break;
+            case MessageType::MASSCANCEL:
+                if(m.owner.empty()) {
+                    return false;
+                }
+                journalMessage(m);
+                if(m.maxPrice >= 0) {
+                    massCancel(m.owner, m.side, max(m.price, 0L), m.maxPrice);
+                }
+                break;
+            default:
+                return false;
+        }       
+        if(snapshotEvery && journaledSinceSnapshot >= snapshotEvery) {
+            writeSnapshot();
+        }
+        if(journal && journal->committedSize() == journal->size()) { // this message's group is on disk
+            releaseOutput();
+        }
+        if(topOfBook && !journal) { // with a journal in releaseOutput
+            publishTopOfBook();
+        }
+        return true;
+    } 
+    
+    void printBook() {
+        auto level = [this](unsigned long price, int qty) { publisher.level(price, qty); };
+        publisher.bookSide(OrderSide::SELL);
+        sellBook.forEachLevel(level);
+        publisher.bookSide(OrderSide::BUY);
+        buyBook.forEachLevel(level);
+        latency->mark(LatencyStage::PUBLISH);
+    }
+
+    // Cancel the resting orders of owner, of one side (UNKNOWN: both) within [minPrice, maxPrice].
+    // Walks the owner's order list of each side asked for, so cancelling k orders costs O(k) whatever the
+    // book size. A price range is filtered on the way: its cost is bounded by the owner's orders on the
+    // side, not by the orders in the range. Every level touched gets its quantity (and market data)
+    // adjusted once. Returns the number of orders canceled
+    size_t massCancel(string_view ownerName, OrderSide side, unsigned long minPrice, unsigned long maxPrice) {
+        auto owner = owners.find(ownerName);
+        latency->mark(LatencyStage::LOOKUP);
+        if(!owner) {
+            return 0;
+        }
+        size_t canceled = 0;
+        for(auto s: {OrderSide::BUY, OrderSide::SELL}) {
+            if(side != OrderSide::UNKNOWN && side != s) {
+                continue;
+            }
+            auto& book = s == OrderSide::BUY ? buyBook : sellBook;
+            for(Order* porder = owner->head[size_t(s)]; porder; ) {
+                Order* next = porder->ownerNext;
+                if(porder->price >= minPrice && porder->price <= maxPrice) {
+                    unlinkOwner(porder);
+                    porder->doneFlag = true;
+                    orderMap.retire(porder, porder->orderId);  // keeps the id, it can not be reused
+                    book.markCanceled(porder);
+                    ++canceled;
+                }
+                porder = next;
+            }
+        }
+        buyBook.applyCanceled();
+        sellBook.applyCanceled();
+        latency->mark(LatencyStage::BOOK);
+        return canceled;
+    }
+
+    const OrderMemoryPool& orderPool() const { return ordpool; }
+
+    // per stage latency histograms, empty unless built with -DME_LATENCY_STATS
+    void dumpLatency(ostream& out) {
+        latency->dump(out, messageTypeNames);
+    }
+
+    void setLatencyLabel(string_view label) { latency->setLabel(label); }
+
+    // record into shared instead of a recorder of the engine's own, e.g. one recorder for all the engines of
+    // a matching thread (the histograms are large). shared must outlive the engine and only be used by one
+    // thread at a time
+    void shareLatency(Latency& shared) {
+        shared.setTypeNames(messageTypeNames);
+        latency = &shared;
+        ownLatency.reset();
+    }
+
+    // wait until the trades and books published so far are handed to the output stream.
+    // with a journal that commits the pending journal group first
+    void flushOutput() {
+        commitJournal();
+        publisher.flush();
+    }
+
+    // wait until all output of the processed messages is written
+    void flush() {
+        commitJournal();
+        publisher.flush();
+        if(depth) {
+            depth->flush();
+        }
+    }
+
+    // commit the pending journal group and let the output it held back go. run() calls it before it waits
+    // for input, so an idle engine has nothing uncommitted
+    void commitJournal() {
+        if(journal) {
+            journal->commit();
+            releaseOutput();
+        }
+    }
+
+    // Restore the books from the latest snapshot (if any) and the journal written after it. Call before
+    // enableJournal, which then continues the same journal. Trades of the replayed messages were published
+    // before the restart and are not published again. Returns the number of journal messages replayed
+    size_t recover(const string& snapshotPath, const string& journalPath) {
+        if(journal) {
+            throw runtime_error("recover must be called before enableJournal");
+        }
+        vector<char> data;
+        uint64_t offset = 0;
+        if(readFileFrom(snapshotPath, 0, data)) {
+            offset = loadSnapshot(data);
+        }
+        size_t replayed = 0;
+        replaying = true;
+        if(readFileFrom(journalPath, offset, data)) {
+            size_t pos = 0;
+            JournalRecord r;
+            while(pos + sizeof(r) <= data.size()) {
+                memcpy(&r, data.data() + pos, sizeof(r));
+                size_t len = sizeof(r) + r.idLen + r.ownerLen;
+                if(r.type >= uint8_t(MessageType::UNKNOWN) || pos + len > data.size()) {
+                    break;  // torn write at the end of the journal
+                }
+                const char* id = data.data() + pos + sizeof(r);
+                OrderMessage m{MessageType(r.type), OrderSide(r.side), OrderType(r.orderType), long(r.price), int(r.qty),
+                               string_view(id, r.idLen), string_view(id + r.idLen, r.ownerLen), long(r.maxPrice)};
+                processMessage(m);
+                pos += len;
+                ++replayed;
+            }
+            offset += pos;
+        }
+        replaying = false;
+        journalResumeAt = offset;
+        return replayed;
+    }
+
+    // Write every accepted message to an append only journal with group commit. With a snapshot path, write
+    // a snapshot now and then after every snapshotEvery journaled messages, so recovery only replays the tail.
+    // Trades, books and depth updates are held back until the group of the message behind them is committed:
+    // nothing is published that a crash could take back. The snapshot is written on the matching thread
+    // (every live order and done id, then fsync), a stall of that length every snapshotEvery messages
+    void enableJournal(const string& journalPath, const JournalWriter::Options& opts,
+                       const string& snapshotPath = string(), uint64_t snapshotEvery_ = 0) {
+        journal = make_unique<JournalWriter>(journalPath, journalResumeAt, opts);
+        publisher.hold();
+        if(depth) {
+            depth->hold();
+        }
+        snapshotFile = snapshotPath;
+        snapshotEvery = snapshotPath.empty() ? 0 : snapshotEvery_;
+        if(!snapshotFile.empty()) {
+            writeSnapshot();
+        }
+    }
+
+    // the live orders in priority order and the done ids, consistent with the journal written so far
+    void writeSnapshot() {
+        journal->commit();  // the snapshot must not cover journal records that are not on disk
+        SnapshotHeader h{{'M', 'E', 'S', 'N', 'A', 'P', '2', 0}, journal->committedSize(), 0, 0, 0};
+        vector<char> data(sizeof(h));
+        auto add = [&data](const void* p, size_t len) {
+            data.insert(data.end(), (const char*)p, (const char*)p + len);
+        };
+        auto addOrder = [&add](const Order& o) {
+            auto owner = o.owner ? o.owner->name : string_view();
+            SnapshotOrder so{int64_t(o.price), int32_t(o.quantity), int32_t(o.leaves), o.orderId.len, uint32_t(owner.size())};
+            add(&so, sizeof(so));
+            add(o.orderId.data, o.orderId.len);
+            add(owner.data(), owner.size());
+        };
+        buyBook.forEachOrder(OrderSide::BUY, [&](const Order& o) { addOrder(o); ++h.buyOrders; });
+        sellBook.forEachOrder(OrderSide::SELL, [&](const Order& o) { addOrder(o); ++h.sellOrders; });
+        orderMap.forEach([&](const OrderIdIndex::Entry& e) {
+            if(!e.order) {
+                add(&e.id.len, sizeof(e.id.len));
+                add(e.id.data, e.id.len);
+                ++h.doneIds;
+            }
+        });
+        memcpy(data.data(), &h, sizeof(h));
+        writeFileAtomically(snapshotFile, data.data(), data.size());
+        journaledSinceSnapshot = 0;
+    }
+
+    // publish L2 depth updates, and every interval (if not 0) the top levels, to os_
+    void enableDepthFeed(ostream& os_, size_t topLevels=5, chrono::milliseconds interval=chrono::milliseconds(0)) {
+        depth = make_unique<DepthFeed>(os_, topLevels, interval);
+        if(journal) {
+            depth->hold();
+        }
+        buyBook.setDepthFeed(depth.get());
+        sellBook.setDepthFeed(depth.get());
+    }
+
+    // publish the best levels (up to TopOfBookView::maxLevels per side) for reader threads after every
+    // message that changes them. with a journal only books whose messages are all committed are published,
+    // when the held output is released. the returned object stays valid for the life of the engine
+    const TopOfBook& enableTopOfBook(size_t levels = 1) {
+        topOfBookLevels = max<size_t>(1, min(levels, TopOfBookView::maxLevels));
+        topOfBook = make_unique<TopOfBook>();
+        return *topOfBook;
+    }
+
+    // push every trade (time, symbol, quantity, price) to the aggregator of feed as its producer-th
+    // producer, only this engine's thread may use that producer. the feed must outlive the engine
+    void enableTradeStats(TradeStatFeed& feed, string_view symbol, size_t producer = 0) {
+        tradeStats = &feed;
+        tradeStatsProducer = producer;
+        memset(tradeSymbol, 0, sizeof(tradeSymbol));
+        memcpy(tradeSymbol, symbol.data(), min(symbol.size(), sizeof(tradeSymbol)));
+    }
+
+    void publishTopLevels() {
+        buyBook.topLevels(OrderSide::BUY, depth->levels(), topBids);
+        sellBook.topLevels(OrderSide::SELL, depth->levels(), topAsks);
+        depth->snapshot(topBids, topAsks);
+    }
+    
+    void run() {
+        forEachLine(is, [this](string_view line) { processInputLine(line); }, readBlockSize,
+                    [this]() { commitJournal(); });
+        flush();
+    }
+
+    void runBinary() {
+        // binary records from the input stream
+        readBinary([this](const BinaryMessage* msgs, size_t n) {
+            for(size_t i=0; i<n; ++i) {
+                processBinaryMessage(msgs[i]);
+            }
+        });
+    }
+
+    void runBinary(const BinaryMessage* msgs, size_t count) {
+        // binary records already in memory, e.g. a memory mapped replay file
+        for(size_t i=0; i<count; ++i) {
+            processBinaryMessage(msgs[i]);
+        }
+        flush();
+    }
+
+    // Batch mode: decode a batch of messages, prefetch what they are going to touch, then process them in
+    // their original order. Prefetching goes stage by stage over the whole batch (id slots, then id text and
+    // Order, then the order's price level), so the cache misses of a batch overlap instead of coming one
+    // after the other. The prefetches are only hints taken before the batch runs: same output as run().
+    void runBatched(size_t batchSize = 16) {
+        batchSize = max<size_t>(1, min(batchSize, maxBatch));
+        forEachLineBatch(is, batchSize, [this](const string_view* lines, size_t n) { processInputBatch(lines, n); },
+                         readBlockSize, [this]() { commitJournal(); });
+        flush();
+    }
+
+    // binary records from the input stream in batches. a batch never waits for records still to come
+    void runBinaryBatched(size_t batchSize = 16) {
+        batchSize = max<size_t>(1, min(batchSize, maxBatch));
+        readBinary([this, batchSize](const BinaryMessage* msgs, size_t n) {
+            for(size_t i=0; i<n; i+=batchSize) {
+                processBinaryBatch(msgs + i, min(batchSize, n - i));
+            }
+        });
+    }
+
+    void runBinaryBatched(const BinaryMessage* msgs, size_t count, size_t batchSize = 16) {
+        batchSize = max<size_t>(1, min(batchSize, maxBatch));
+        for(size_t i=0; i<count; i+=batchSize) {
+            processBinaryBatch(msgs + i, min(batchSize, count - i));
+        }
+        flush();
+    }
+
+    void processInputBatch(const string_view* lines, size_t n) {
+        for(size_t first=0; first<n; first+=maxBatch) {
+            size_t count = min(maxBatch, n - first);
+            for(size_t i=0; i<count; ++i) { // bad input is reported in order, when the batch gets to it
+                auto t = latencyStatsEnabled ? readTimestamp() : 0;
+                batchValid[i] = parseInputLine(lines[first + i], batch[i], false);
+                batchParseTicks[i] = latencyStatsEnabled ? readTimestamp() - t : 0;
+            }
+            batchLines = lines + first;
+            processBatch(count);
+            batchLines = nullptr;
+        }
+    }
+
+    void processBinaryBatch(const BinaryMessage* msgs, size_t n) {
+        for(size_t first=0; first<n; first+=maxBatch) {
+            size_t count = min(maxBatch, n - first);
+            for(size_t i=0; i<count; ++i) {
+                auto t = latencyStatsEnabled ? readTimestamp() : 0;
+                batchValid[i] = decodeMessage(msgs[first + i], batch[i]);
+                batchParseTicks[i] = latencyStatsEnabled ? readTimestamp() - t : 0;
+            }
+            processBatch(count);
+        }
+    }
+    
+private:
+    static constexpr size_t readBlockSize = 1 << 20;
+    istream& is;
+    ostream& os;
+    OrderMemoryPool ordpool;    
+    OrderIdIndex orderMap;
+    OrderOwnerIndex owners;
+    OrderBook buyBook;
+    OrderBook sellBook;
+    TradePublisher publisher;  // after orderMap: drained before the interned ids go away
+    vector<TradeDetail> trades;
+    unique_ptr<DepthFeed> depth;
+    vector<pair<unsigned long, int>> topBids;
+    vector<pair<unsigned long, int>> topAsks;
+    unique_ptr<Latency> ownLatency;
+    Latency* latency;                     // ownLatency, or shared with other engines
+    unique_ptr<JournalWriter> journal;
+    string snapshotFile;
+    uint64_t snapshotEvery = 0;           // journaled messages between snapshots, 0: none
+    uint64_t journaledSinceSnapshot = 0;
+    uint64_t journalResumeAt = 0;         // journal length restored by recover
+    bool replaying = false;               // recovering, trades were already published
+    static constexpr size_t maxBatch = 64;
+    OrderMessage batch[maxBatch];
+    bool batchValid[maxBatch];
+    uint32_t batchHash[maxBatch];
+    uint64_t batchParseTicks[maxBatch];
+    const string_view* batchLines = nullptr;  // text of the batch, to report bad input
+    unique_ptr<TopOfBook> topOfBook;
+    TopOfBookView lastTop;                // as last published
+    size_t topOfBookLevels = 0;
+    TradeStatFeed* tradeStats = nullptr;
+    size_t tradeStatsProducer = 0;
+    vector<TradeEvent> heldTrades;        // with a journal: trade statistics not released yet
+    char tradeSymbol[8] = {};
+
+    // read a block of records at a time and call f(records, n) with the whole records of every read
+    template<typename F>
+    void readBinary(F&& f) {
+        vector<BinaryMessage> buf(readBlockSize / sizeof(BinaryMessage));
+        size_t filled = 0;  // bytes in buf
+        while(true) {
+            auto n = readAvailable(is, (char*)buf.data() + filled, buf.size() * sizeof(BinaryMessage) - filled,
+                                   [this]() { commitJournal(); });
+            if(n == 0) {
+                break;
+            }
+            filled += n;
+            size_t records = filled / sizeof(BinaryMessage);
+            f(buf.data(), records);
+            filled -= records * sizeof(BinaryMessage);
+            memmove(buf.data(), buf.data() + records, filled);
+        }
+        if(filled > 0) {
+            std::cerr << "Truncated binary message at end of input. Ignored.\n";
+        }
+        flush();
+    }
+
+    void processBatch(size_t n) {
+        auto hasId = [this](size_t i) { return batchValid[i] && !batch[i].orderId.empty(); };
+        for(size_t i=0; i<n; ++i) {
+            if(hasId(i)) {
+                batchHash[i] = hashOrderId(batch[i].orderId);
+                orderMap.prefetch(batchHash[i]);
+            }
+        }
+        for(size_t i=0; i<n; ++i) {
+            if(hasId(i)) {
+                if(auto pe = orderMap.candidate(batchHash[i])) {
+                    __builtin_prefetch(pe->id.data);
+                    if(pe->order) {
+                        __builtin_prefetch(pe->order);
+                    }
+                }
+            }
+        }
+        for(size_t i=0; i<n; ++i) {
+            if(hasId(i) && (batch[i].type == MessageType::CANCEL || batch[i].type == MessageType::MODIFY)) {
+                auto pe = orderMap.candidate(batchHash[i]);
+                if(pe && pe->order && pe->order->inBook) {  // a live order, its level exists
+                    __builtin_prefetch(pe->order->level);
+                }
+            }
+        }
+        for(size_t i=0; i<n; ++i) {
+            latency->start();
+            latency->add(LatencyStage::PARSE, batchParseTicks[i]);  // parsed ahead with the whole batch
+            if(!batchValid[i] && batchLines) {
+                parseInputLine(batchLines[i], batch[i]);  // again, to report it
+            }
+            bool ok = batchValid[i] && processMessage(batch[i]);
+            latency->finish(ok ? size_t(batch[i].type) : size_t(MessageType::UNKNOWN));
+        }
+    }
+
+    void publishTopOfBook() {
+        TopOfBookView v;
+        v.bidLevels = buyBook.topLevels(OrderSide::BUY, topOfBookLevels, v.bids);
+        v.askLevels = sellBook.topLevels(OrderSide::SELL, topOfBookLevels, v.asks);
+        // most messages do not touch the top, those cost the compare only
+        if(v.bidLevels != lastTop.bidLevels || v.askLevels != lastTop.askLevels
+           || memcmp(v.bids, lastTop.bids, sizeof(BookLevel) * v.bidLevels) != 0
+           || memcmp(v.asks, lastTop.asks, sizeof(BookLevel) * v.askLevels) != 0) {
+            topOfBook->publish(v, topOfBookLevels);
+            lastTop = v;
+            latency->mark(LatencyStage::PUBLISH);
+        }
+    }
+
+    void releaseOutput() {
+        publisher.release();
+        if(depth) {
+            depth->release();
+        }
+        for(auto& ev: heldTrades) {
+            tradeStats->push(tradeStatsProducer, ev);
+        }
+        heldTrades.clear();
+        if(topOfBook) { // every message so far is committed, so is this book
+            publishTopOfBook();
+        }
+    }
+
+    void journalMessage(const OrderMessage& m) {
+        if(journal) {
+            JournalRecord r{uint8_t(m.type), uint8_t(m.side), uint8_t(m.orderType), 0, uint32_t(m.orderId.size()),
+                            int64_t(m.price), int32_t(m.qty), uint32_t(m.owner.size()), int64_t(m.maxPrice)};
+            journal->append(&r, sizeof(r), m.orderId.data(), m.orderId.size(), m.owner.data(), m.owner.size());
+            ++journaledSinceSnapshot;
+        }
+    }
+
+    // the trades of one incoming order share a time stamp. with a journal they wait in heldTrades like
+    // the other output, until the journal group of the order is committed
+    void publishTradeStats() {
+        TradeEvent ev{TradeStatFeed::now(), {}, 0, 0, 0};
+        memcpy(ev.symbol, tradeSymbol, sizeof(ev.symbol));
+        for(auto& trade: trades) {
+            ev.price = int64_t(trade.priceBook);
+            ev.quantity = trade.fillQty;
+            if(journal) {
+                heldTrades.push_back(ev);
+            }
+            else {
+                tradeStats->push(tradeStatsProducer, ev);
+            }
+        }
+    }
+
+    // returns the journal offset covered by the snapshot
+    uint64_t loadSnapshot(const vector<char>& data) {
+        SnapshotHeader h;
+        if(data.size() < sizeof(h) || memcmp(data.data(), "MESNAP2", 8) != 0) {
+            throw runtime_error("Bad snapshot");
+        }
+        memcpy(&h, data.data(), sizeof(h));
+        size_t pos = sizeof(h);
+        auto take = [&data, &pos](void* p, size_t len) {
+            if(pos + len > data.size()) {
+                throw runtime_error("Truncated snapshot");
+            }
+            memcpy(p, data.data() + pos, len);
+            pos += len;
+        };
+        auto id = [&data, &pos](size_t len) {
+            if(pos + len > data.size()) {
+                throw runtime_error("Truncated snapshot");
+            }
+            pos += len;
+            return string_view(data.data() + pos - len, len);
+        };
+        for(uint64_t i=0; i<h.buyOrders + h.sellOrders; ++i) {
+            SnapshotOrder so;
+            take(&so, sizeof(so));
+            auto side = i < h.buyOrders ? OrderSide::BUY : OrderSide::SELL;
+            auto [pe, inserted] = orderMap.tryEmplace(id(so.idLen));
+            if(!inserted) {
+                throw runtime_error("Duplicate order id in snapshot");
+            }
+            // added in priority order, so the level queues come back as they were
+            Order* porder = new(ordpool.getNext()) Order{side, OrderType::GFD, (unsigned long)so.price, so.quantity, so.leaves,
+                                                        pe->id, false, false};
+            pe->order = porder;
+            (side == OrderSide::BUY ? buyBook : sellBook).addOrder(porder);
+            if(auto owner = id(so.ownerLen); !owner.empty()) {
+                linkOwner(porder, owners.get(owner));
+            }
+        }
+        for(uint64_t i=0; i<h.doneIds; ++i) {
+            uint32_t len;
+            take(&len, sizeof(len));
+            orderMap.tryEmplace(id(len));
+        }
+        return h.journalOffset;
+    }
+    
+    template<OrderSide side> 
+    bool processNewOrder(Order* porder, OrderOwner* owner) {
+        auto matchBook = [this]() -> auto& {
+            if constexpr (side == OrderSide::BUY) {
+                return sellBook;
+            }
+            if constexpr (side == OrderSide::SELL) {
+                return buyBook;
+            }
+        };
+        auto resBook = [this]() -> auto& {
+            if constexpr (side == OrderSide::BUY) {
+                return buyBook;
+            }
+            if constexpr (side == OrderSide::SELL) {
+                return sellBook;
+            }
+        };
+        trades.clear();  // reused from order to order
+        auto ret = matchBook().tryMatchOrder(*porder, trades);
+        latency->mark(LatencyStage::MATCH);
+        if(ret.first && !replaying) { // match happened
+            for(auto& trade: trades) {
+                publisher.trade(trade);
+            }
+            if(tradeStats) {
+                publishTradeStats();
+            }
+            latency->mark(LatencyStage::PUBLISH);
+        }
+        if(porder->leaves > 0 && porder->type == OrderType::GFD) { // only GFD order goes to the the orderbook
+            auto it = resBook().addOrder(porder);
+            if(owner) {
+                linkOwner(porder, owner);
+            }
+        }
+        else {
+            porder->doneFlag = true;
+            orderMap.retire(porder, porder->orderId);
+            ordpool.release(porder);  // never reached the book, nothing else refers to it
+        }
+        latency->mark(LatencyStage::BOOK);
+        return true;
+        
+    }
+    
+    bool processBuyOrder(string_view orderId, OrderType otype, unsigned long price, int qty, string_view owner){
+        auto [pe, inserted] = orderMap.tryEmplace(orderId);
+        if(!inserted) { //already exists
+            latency->mark(LatencyStage::LOOKUP);
+            return false;
+        }
+        //Any order passed validation check has a place in the map
+        Order* porder = new(ordpool.getNext()) Order{OrderSide::BUY, otype, price, qty, qty, pe->id, false, false};
+        pe->order = porder;
+        auto powner = owner.empty() ? nullptr : owners.get(owner);
+        latency->mark(LatencyStage::LOOKUP);
+        return processNewOrder<OrderSide::BUY>(porder, powner);
+    }        
+
+    bool processSellOrder(string_view orderId, OrderType otype, unsigned long price, int qty, string_view owner) {
+        auto [pe, inserted] = orderMap.tryEmplace(orderId);
+        if(!inserted) {
+            latency->mark(LatencyStage::LOOKUP);
+            return false;
+        }
+        Order* porder = new(ordpool.getNext()) Order{OrderSide::SELL, otype, price, qty, qty, pe->id, false, false};
+        pe->order = porder;
+        auto powner = owner.empty() ? nullptr : owners.get(owner);
+        latency->mark(LatencyStage::LOOKUP);
+        return processNewOrder<OrderSide::SELL>(porder, powner);
+    }
+
+    bool modifyOrder(string_view orderId, OrderSide side, unsigned long price, int qty) {
+        //find the order, delete it and add the new order
+        //new order has to be on the same side of the old order
+        //if new order qty is less than or equal to filled qty. new order will not be created
+        //if qty is smaller while price no change, it does not change the order priority
+        auto pe = orderMap.find(orderId);
+        latency->mark(LatencyStage::LOOKUP);
+        if(!pe || !pe->order || pe->order->side != side) { //either order not exist or order is done already or side changed, do nothing
+            return false;
+        }
+        
+        // mark the old order as Done
+        auto fillQty = pe->order->quantity - pe->order->leaves;
+        if(fillQty < qty && qty <= pe->order->quantity && pe->order->price == price) {
+            auto delta = pe->order->quantity - qty;
+            pe->order->quantity = qty;
+            pe->order->leaves = qty - fillQty;
+            // update level
+            if(side == OrderSide::BUY) {
+                buyBook.reduceOrder(pe->order, delta); 
+            }
+            else {
+                sellBook.reduceOrder(pe->order, delta);
+            }
+            latency->mark(LatencyStage::BOOK);
+            return true;
+        }
+
+        Order* pold = pe->order;
+        Order* porder = nullptr;
+        OrderOwner* owner = pold->owner;  // the replacing order keeps the owner
+        if(fillQty < qty) {
+            // copy before the old order is canceled: the book may hand its slot back to the pool
+            porder = new(ordpool.getNext()) Order(*pold);
+        }
+        pe->order = porder;  // the id now belongs to the new order, or to nothing
+        pold->doneFlag = true;
+        unlinkOwner(pold);
+        if(pold->side == OrderSide::BUY) {
+            buyBook.cancelOrder(pold);
+        }
+        else {
+            sellBook.cancelOrder(pold);
+        }
+        latency->mark(LatencyStage::BOOK);
+        
+        if(fillQty >= qty ) {
+            return false;
+        }
+
+        // set the attributes of the new order
+        porder->quantity = qty;
+        porder->price = price;
+        porder->leaves = qty - fillQty;
+        porder->doneFlag = false;
+        porder->inBook = false;
+        porder->owner = nullptr;
+        
+        if(side == OrderSide::BUY) {
+            return processNewOrder<OrderSide::BUY>(porder, owner);
+        }
+        else {
+            return processNewOrder<OrderSide::SELL>(porder, owner);
+        }
+        return false;   
+    }
+    bool cancelOrder(string_view orderId) {
+        // return true if no error happens
+        auto pe = orderMap.find(orderId);
+        latency->mark(LatencyStage::LOOKUP);
+        if(!pe || !pe->order) { // order not found or already done
+            return false;
+        }
+        Order* porder = pe->order;
+        porder->doneFlag = true;
+        pe->order = nullptr;  // keep the id, it can not be reused
+        unlinkOwner(porder);
+        if(porder->side == OrderSide::BUY) {
+            buyBook.cancelOrder(porder);
+        }
+        else {
+            sellBook.cancelOrder(porder);
+        }
+        latency->mark(LatencyStage::BOOK);
+        return true;        
+    } 
+};
@@ -0,0 +1,35 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "OrderFlowGenerator.hpp"
+
+// write a synthetic message flow to STDOUT, e.g. ./gen --messages 1000000 --seed 7 > flow.in
+int main(int argc, char* argv[]) {
+    OrderFlowConfig cfg;
+    size_t messages = 1000000;
+    for(int i=1; i<argc; ++i) {
+        std::string_view arg = argv[i];
+        if(arg == "--messages" && i+1 < argc) {
+            messages = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if(i+1 < argc && setFlowOption(cfg, arg, argv[i+1])) {
+            ++i;
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--messages n] [options]\n" << flowOptionsHelp();
+            return -1;
+        }
+    }
+    std::ios::sync_with_stdio(false);
+    OrderFlowGenerator gen(cfg);
+    std::string out;
+    const size_t batch = 4096;
+    for(size_t done=0; done<messages; done+=batch) {
+        out.clear();
+        gen.generate(std::min(batch, messages - done), out);
+        std::cout.write(out.data(), out.size());
+    }
+    std::cout.flush();
+    return 0;
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <cstdlib>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <queue>
+#include <charconv>
+
+// OrderFlowGenerator produces a deterministic synthetic message flow in the text input format of MatchEngine.
+// The same config (and seed) always gives the same flow, on any platform: the generator uses its own random
+// number generator, no std distribution.
+// Prices are placed around a reference price that drifts one tick at a time. A new order is passive (at or
+// behind the touch, a geometric number of ticks away, at most depthLevels) or, with crossRatio, priced through
+// the touch so it trades. Every order gets a lifetime (exponential, in messages), CANCEL and MODIFY pick the
+// order whose lifetime ends first. Orders filled in the engine are not known to the generator, cancels of
+// those are rejected by the engine like they would be in a real flow.
+
+struct OrderFlowConfig {
+    uint64_t seed = 1;
+    double newWeight = 0.55;        // message mix, relative weights
+    double modifyWeight = 0.15;
+    double cancelWeight = 0.30;
+    double printWeight = 0.0;
+    double iocRatio = 0.1;          // share of IOC among new orders
+    double crossRatio = 0.1;        // share of new orders priced through the touch
+    double meanDistance = 4;        // mean distance from the touch in ticks
+    size_t depthLevels = 50;        // a passive order is at most this many ticks from the touch
+    double meanLifetime = 2000;     // mean order lifetime in messages
+    size_t maxLive = 50000;         // live orders the generator keeps at most, a NEW becomes a CANCEL beyond
+    double driftRatio = 0.01;       // chance per message that the reference price moves one tick
+    unsigned long referencePrice = 10000;
+    unsigned long tick = 1;
+    int minQty = 1;
+    int maxQty = 200;
+};
+
+class OrderFlowGenerator {
+public:
+    explicit OrderFlowGenerator(const OrderFlowConfig& cfg_) : cfg(cfg_), rng(cfg_.seed), now(0), nextId(0),
+        reference(cfg_.referencePrice) {}
+
+    // append the next message (with the newline) to out
+    void next(std::string& out) {
+        ++now;
+        if(uniform() < cfg.driftRatio) {
+            reference += uniform() < 0.5 ? cfg.tick : -cfg.tick;
+            if(reference < cfg.tick * (cfg.depthLevels + 2)) {
+                reference = cfg.tick * (cfg.depthLevels + 2);
+            }
+        }
+        double total = cfg.newWeight + cfg.modifyWeight + cfg.cancelWeight + cfg.printWeight;
+        double x = uniform() * total;
+        if(x < cfg.newWeight) {
+            if(liveCount == 0 || liveCount < cfg.maxLive) {
+                newOrder(out);
+            }
+            else {
+                cancelOrder(out);
+            }
+        }
+        else if(x < cfg.newWeight + cfg.modifyWeight) {
+            if(liveCount == 0) {
+                newOrder(out);
+            }
+            else {
+                modifyOrder(out);
+            }
+        }
+        else if(x < cfg.newWeight + cfg.modifyWeight + cfg.cancelWeight) {
+            if(liveCount == 0) {
+                newOrder(out);
+            }
+            else {
+                cancelOrder(out);
+            }
+        }
+        else {
+            out += "PRINT\n";
+        }
+    }
+
+    // append count messages to out
+    void generate(size_t count, std::string& out) {
+        for(size_t i=0; i<count; ++i) {
+            next(out);
+        }
+    }
+
+private:
+    struct GenOrder {
+        bool buy;
+        bool alive;
+        unsigned long price;
+        int qty;
+    };
+
+    OrderFlowConfig cfg;
+    uint64_t rng;
+    uint64_t now;
+    uint64_t nextId;
+    unsigned long reference;
+    std::vector<GenOrder> orders;                 // by order number
+    size_t liveCount = 0;
+    using Expiry = std::pair<uint64_t, uint64_t>; // (end of life, order number)
+    std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>> expiries;
+
+    uint64_t random() { // splitmix64
+        uint64_t z = (rng += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() { // [0, 1)
+        return (random() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    uint64_t geometric(double mean) {
+        if(mean <= 0) {
+            return 0;
+        }
+        double u = 1.0 - uniform();  // (0, 1]
+        return uint64_t(std::floor(std::log(u) / std::log(mean / (mean + 1.0))));
+    }
+
+    int quantity() {
+        return cfg.minQty + int(random() % uint64_t(cfg.maxQty - cfg.minQty + 1));
+    }
+
+    unsigned long priceFor(bool buy) {
+        unsigned long d = std::min<uint64_t>(geometric(cfg.meanDistance), cfg.depthLevels - 1) * cfg.tick;
+        if(uniform() < cfg.crossRatio) { // through the touch
+            return buy ? reference + cfg.tick + d : reference - cfg.tick - d;
+        }
+        return buy ? reference - cfg.tick - d : reference + cfg.tick + d;
+    }
+
+    static void appendNumber(std::string& out, uint64_t v) {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), v);
+        out.append(buf, res.ptr - buf);
+    }
+
+    static void appendId(std::string& out, uint64_t n) {
+        out += 'o';
+        appendNumber(out, n);
+    }
+
+    void newOrder(std::string& out) {
+        bool buy = random() & 1;
+        bool ioc = uniform() < cfg.iocRatio;
+        auto price = priceFor(buy);
+        auto qty = quantity();
+        uint64_t id = nextId++;
+        orders.push_back(GenOrder{buy, !ioc, price, qty});
+        if(!ioc) {
+            ++liveCount;
+            expiries.emplace(now + 1 + uint64_t(-std::log(1.0 - uniform()) * cfg.meanLifetime), id);
+        }
+        out += buy ? (ioc ? "NEW BUY IOC " : "NEW BUY GFD ") : (ioc ? "NEW SELL IOC " : "NEW SELL GFD ");
+        appendNumber(out, price);
+        out += ' ';
+        appendNumber(out, qty);
+        out += ' ';
+        appendId(out, id);
+        out += '\n';
+    }
+
+    uint64_t firstToExpire() {
+        while(!orders[expiries.top().second].alive) { // lazily drop entries of removed orders
+            expiries.pop();
+        }
+        return expiries.top().second;
+    }
+
+    void cancelOrder(std::string& out) {
+        uint64_t id = firstToExpire();
+        orders[id].alive = false;
+        --liveCount;
+        out += "CANCEL ";
+        appendId(out, id);
+        out += '\n';
+    }
+
+    void modifyOrder(std::string& out) {
+        // replace the order at the end of its life: new price (loses priority) or smaller qty (keeps it)
+        uint64_t id = firstToExpire();
+        expiries.pop();
+        auto& o = orders[id];
+        if(uniform() < 0.5 || o.qty <= 1) {
+            o.price = priceFor(o.buy);
+            o.qty = quantity();
+        }
+        else {
+            o.qty = 1 + int(random() % uint64_t(o.qty - 1));
+        }
+        expiries.emplace(now + 1 + uint64_t(-std::log(1.0 - uniform()) * cfg.meanLifetime), id);
+        out += "MODIFY ";
+        appendId(out, id);
+        out += o.buy ? " BUY " : " SELL ";
+        appendNumber(out, o.price);
+        out += ' ';
+        appendNumber(out, o.qty);
+        out += '\n';
+    }
+};
+
+// set one config field from a command line option, e.g. "--ioc" "0.2". returns false for an unknown option
+inline bool setFlowOption(OrderFlowConfig& cfg, std::string_view name, const char* value) {
+    if(name == "--seed") cfg.seed = std::strtoull(value, nullptr, 10);
+    else if(name == "--new") cfg.newWeight = std::atof(value);
+    else if(name == "--modify") cfg.modifyWeight = std::atof(value);
+    else if(name == "--cancel") cfg.cancelWeight = std::atof(value);
+    else if(name == "--print") cfg.printWeight = std::atof(value);
+    else if(name == "--ioc") cfg.iocRatio = std::atof(value);
+    else if(name == "--cross") cfg.crossRatio = std::atof(value);
+    else if(name == "--distance") cfg.meanDistance = std::atof(value);
+    else if(name == "--depth") cfg.depthLevels = std::max(1ul, std::strtoul(value, nullptr, 10));
+    else if(name == "--lifetime") cfg.meanLifetime = std::atof(value);
+    else if(name == "--max-live") cfg.maxLive = std::strtoul(value, nullptr, 10);
+    else if(name == "--drift") cfg.driftRatio = std::atof(value);
+    else if(name == "--price") cfg.referencePrice = std::strtoul(value, nullptr, 10);
+    else if(name == "--max-qty") cfg.maxQty = std::max(cfg.minQty, std::atoi(value));
+    else return false;
+    return true;
+}
+
+inline const char* flowOptionsHelp() {
+    return "  --seed n       random seed (1)\n"
+           "  --new w --modify w --cancel w --print w   message mix weights (0.55 0.15 0.30 0)\n"
+           "  --ioc r        share of IOC orders (0.1)\n"
+           "  --cross r      share of orders priced through the touch (0.1)\n"
+           "  --distance t   mean distance from the touch in ticks (4)\n"
+           "  --depth n      passive orders at most n ticks from the touch (50)\n"
+           "  --lifetime n   mean order lifetime in messages (2000)\n"
+           "  --max-live n   live orders at most (50000)\n"
+           "  --drift r      chance per message that the price moves a tick (0.01)\n"
+           "  --price p      start price (10000)\n"
+           "  --max-qty q    order qty is 1 to q (200)\n";
+}
+
+// OutputChecksum is a streambuf that keeps a FNV-1a hash of everything written to it, and drops the bytes.
+// the golden check of a flow compares the hash of the engine output instead of the output itself
+class OutputChecksum : public std::streambuf {
+public:
+    OutputChecksum() { setp(buf, buf + sizeof(buf)); }
+
+    uint64_t value() {
+        sync();
+        return hash;
+    }
+
+    uint64_t bytes() {
+        sync();
+        return count;
+    }
+
+protected:
+    int overflow(int c) override {
+        sync();
+        if(c != traits_type::eof()) {
+            *pptr() = char(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        for(const char* p = pbase(); p != pptr(); ++p) {
+            hash = (hash ^ (unsigned char)*p) * 0x100000001B3ULL;
+        }
+        count += pptr() - pbase();
+        setp(buf, buf + sizeof(buf));
+        return 0;
+    }
+
+private:
+    char buf[4096];
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint64_t count = 0;
+};
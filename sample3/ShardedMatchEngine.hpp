@@ -0,0 +1,378 @@
+#pragma once
+
+#include <thread>
+#include <memory>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <pthread.h>
+
+#include "MatchEngine.hpp"
+#include "../sample1/CircularQueue.hpp"
+#include "Doorbell.hpp"
+
+// ShardedMatchEngine handles many symbols.
+// The gateway (the thread calling run) parses the input and routes every message by symbol to one of N
+// matching threads. A matching thread owns a MatchEngine per symbol routed to it. What the engines print
+// goes to a single output thread, every line prefixed with the symbol.
+// gateway -> matcher and matcher -> output are single producer single consumer rings, so no locks are taken,
+// and all messages of a symbol go through one matcher in order, which keeps the per symbol sequence.
+// Matchers and the output thread sleep when their rings are empty (see Doorbell).
+
+// symbol name (up to 8 chars) packed in an integer, used as routing key
+inline uint64_t symbolKey(string_view symbol) {
+    uint64_t key = 0;
+    memcpy(&key, symbol.data(), min(symbol.size(), sizeof(key)));
+    return key;
+}
+
+inline void pinThread(std::thread& t, int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(t.native_handle(), sizeof(cpus), &cpus);  // best effort, runs unpinned on failure
+}
+
+// MessageOutputBuf collects what an engine prints for one message, reused from message to message
+class MessageOutputBuf : public streambuf {
+public:
+    MessageOutputBuf(size_t capacity = 4096) : buf(capacity) {
+        clear();
+    }
+    string_view view() const { return string_view(pbase(), pptr() - pbase()); }
+    void clear() { setp(buf.data(), buf.data() + buf.size()); }
+
+protected:
+    int overflow(int c) override {
+        auto used = pptr() - pbase();
+        buf.resize(buf.size() * 2);
+        setp(buf.data(), buf.data() + buf.size());
+        pbump(int(used));
+        if(c != traits_type::eof()) {
+            *pptr() = char(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    vector<char> buf;
+};
+
+class ShardedMatchEngine {
+public:
+    // with tradeStats, matcher i pushes the trades of its symbols to tradeStats as producer i.
+    // every symbol's engine gets an order pool with poolOpts. latency (built with -DME_LATENCY_STATS) is
+    // recorded per matching thread, or with latencyPerSymbol per symbol (large histograms for every symbol)
+    ShardedMatchEngine(size_t shards, istream& is_=std::cin, ostream& os_=std::cout, int firstCpu=1,
+                       TradeStatFeed* tradeStats=nullptr, const OrderMemoryPool::Options& poolOpts=OrderMemoryPool::Options{64},
+                       bool latencyPerSymbol=false)
+    : is(is_), os(os_) {
+        shards = max<size_t>(shards, 1);
+        if(tradeStats && tradeStats->producers() < shards) {
+            throw runtime_error("Trade statistics feed needs a producer per shard");
+        }
+        int ncpu = max(1u, std::thread::hardware_concurrency());
+        for(size_t i=0; i<shards; ++i) {
+            matchers.emplace_back(new Matcher);
+            matchers.back()->tradeStats = tradeStats;
+            matchers.back()->index = i;
+            matchers.back()->poolOpts = poolOpts;
+            matchers.back()->outputReady = &outputReady;
+            matchers.back()->latencyPerSymbol = latencyPerSymbol;
+            matchers.back()->latency.setLabel("shard " + to_string(i));
+        }
+        writer = std::thread([this]() { writeOutput(); });
+        for(size_t i=0; i<shards; ++i) {
+            matchers[i]->thread = std::thread([this, i]() { matchers[i]->run(); });
+            pinThread(matchers[i]->thread, int((firstCpu + i) % ncpu));
+        }
+    }
+
+    ~ShardedMatchEngine() {
+        stop();
+    }
+
+    ShardedMatchEngine(const ShardedMatchEngine&) = delete;
+    ShardedMatchEngine& operator=(const ShardedMatchEngine&) = delete;
+
+    // text input, every line is "<symbol> <message>"
+    void run() {
+        forEachLine(is, [this](string_view line) { processInputLine(line); });
+        stop();
+    }
+
+    // binary input from the input stream, the symbol is taken from the record
+    void runBinary() {
+        vector<BinaryMessage> buf(4096);
+        size_t filled = 0;
+        while(true) {
+            auto n = readAvailable(is, (char*)buf.data() + filled, buf.size() * sizeof(BinaryMessage) - filled);
+            if(n == 0) {
+                break;
+            }
+            filled += n;
+            size_t records = filled / sizeof(BinaryMessage);
+            for(size_t i=0; i<records; ++i) {
+                route(buf[i]);
+            }
+            filled -= records * sizeof(BinaryMessage);
+            memmove(buf.data(), buf.data() + records, filled);
+        }
+        if(filled > 0) {
+            std::cerr << "Truncated binary message at end of input. Ignored.\n";
+        }
+        stop();
+    }
+
+    void runBinary(const BinaryMessage* msgs, size_t count) {
+        for(size_t i=0; i<count; ++i) {
+            route(msgs[i]);
+        }
+        stop();
+    }
+
+    bool processInputLine(string_view line) {
+        string_view symbol;
+        string_view msg;
+        if(!splitSymbol(line, symbol, msg)) {
+            std::cerr << "Bad input, no symbol: " << line << " Ignored.\n";
+            return false;
+        }
+        OrderMessage m;
+        if(!parseInputLine(msg, m)) {
+            return false;
+        }
+        BinaryMessage bm;
+        if(!encodeMessage(m, bm, symbol)) {
+            std::cerr << "Symbol or order id too long, or text only message: " << line << " Ignored.\n";
+            return false;
+        }
+        return route(bm);
+    }
+
+    // latency histograms (built with -DME_LATENCY_STATS) per matching thread or per symbol, after the input
+    // is done
+    void dumpLatency(ostream& out) {
+        stop();
+        for(auto& pm: matchers) {
+            if(!pm->latencyPerSymbol) {
+                pm->latency.dump(out, MatchEngine::messageTypeNames);
+                continue;
+            }
+            for(auto& [symbol, engine]: pm->books) {
+                engine->dumpLatency(out);
+            }
+        }
+    }
+
+    // send the end of input to all matchers and wait until all output is written
+    void stop() {
+        if(stopped) {
+            return;
+        }
+        stopped = true;
+        for(auto& pm: matchers) {
+            push(pm->input, ShardMessage{BinaryMessage{}, endOfInput});
+            pm->inputReady.ring();
+        }
+        for(auto& pm: matchers) {
+            pm->thread.join();
+        }
+        writer.join();
+    }
+
+private:
+    static constexpr uint32_t endOfInput = ~0u;
+    static constexpr size_t ringSize = 4096;
+
+    struct ShardMessage {
+        BinaryMessage msg;
+        uint32_t book;   // index of the symbol's engine in the matcher, assigned by the gateway
+    };
+
+    // output of one message is a sequence of chunks, the last one has last set.
+    // the output thread does not switch to another matcher in the middle of a message
+    struct OutputChunk {
+        uint16_t len;
+        bool last;
+        bool done;  // matcher finished, no more chunks from it
+        char data[252];
+    };
+
+    struct Route {
+        uint32_t shard;
+        uint32_t book;
+    };
+
+    struct Matcher {
+        CircularQueue<ShardMessage, ringSize> input;
+        CircularQueue<OutputChunk, ringSize> output;
+        vector<pair<string, unique_ptr<MatchEngine>>> books;  // symbol and its engine
+        MessageOutputBuf outbuf;
+        ostream engineOut{&outbuf};  // shared by the engines of this matcher, they run one message at a time
+        std::thread thread;
+        TradeStatFeed* tradeStats = nullptr;
+        size_t index = 0;
+        OrderMemoryPool::Options poolOpts;
+        Doorbell inputReady;               // rung by the gateway
+        MatchEngine::Latency latency;      // shared by the engines of this matcher
+        bool latencyPerSymbol = false;
+        Doorbell* outputReady = nullptr;   // the output thread's
+
+        void run() {
+            while(true) {
+                auto pm = input.front();
+                if(!pm) {
+                    inputReady.wait([this]() { return input.front() != nullptr; });
+                    continue;
+                }
+                if(pm->book == endOfInput) {
+                    input.popFront();
+                    OutputChunk chunk{0, true, true, {}};
+                    ShardedMatchEngine::push(output, chunk);
+                    outputReady->ring();
+                    return;
+                }
+                if(pm->book == books.size()) { // first message of a new symbol
+                    books.emplace_back(string(symbolOf(pm->msg)),
+                                       make_unique<MatchEngine>(std::cin, engineOut, poolOpts));
+                    if(latencyPerSymbol) {
+                        books.back().second->setLatencyLabel(books.back().first);
+                    }
+                    else {
+                        books.back().second->shareLatency(latency);
+                    }
+                    if(tradeStats) {
+                        books.back().second->enableTradeStats(*tradeStats, books.back().first, index);
+                    }
+                }
+                auto& [symbol, engine] = books[pm->book];
+                engine->processBinaryMessage(pm->msg);
+                input.popFront();
+                if(!outbuf.view().empty()) {
+                    publish(symbol, outbuf.view());
+                    outbuf.clear();
+                }
+            }
+        }
+
+        void publish(string_view symbol, string_view text) {
+            // copy the text to output chunks, starting every line with the symbol
+            OutputChunk chunk{0, false, false, {}};
+            auto append = [this, &chunk](string_view sv) {
+                while(!sv.empty()) {
+                    size_t n = min(sv.size(), sizeof(chunk.data) - chunk.len);
+                    memcpy(chunk.data + chunk.len, sv.data(), n);
+                    chunk.len += n;
+                    sv.remove_prefix(n);
+                    if(chunk.len == sizeof(chunk.data)) {
+                        ShardedMatchEngine::push(output, chunk);
+                        outputReady->ring();
+                        chunk.len = 0;
+                    }
+                }
+            };
+            size_t start = 0;
+            while(start < text.size()) {
+                auto nl = text.find('\n', start);
+                size_t end = nl == string_view::npos ? text.size() : nl + 1;
+                append(symbol);
+                append(" ");
+                append(text.substr(start, end - start));
+                start = end;
+            }
+            chunk.last = true;
+            ShardedMatchEngine::push(output, chunk);
+            outputReady->ring();
+        }
+    };
+
+    istream& is;
+    ostream& os;
+    vector<unique_ptr<Matcher>> matchers;
+    vector<uint32_t> booksPerShard;
+    unordered_map<uint64_t, Route> routes;
+    std::thread writer;
+    Doorbell outputReady;  // rung by the matchers
+    bool stopped = false;
+
+    template<typename Q, typename T>
+    static void push(Q& q, const T& t) {
+        while(!q.enQueue(t)) { // ring full, wait for the consumer
+            std::this_thread::yield();
+        }
+    }
+
+    bool route(const BinaryMessage& bm) {
+        auto symbol = symbolOf(bm);
+        if(symbol.empty()) {
+            return false;
+        }
+        auto [it, inserted] = routes.try_emplace(symbolKey(symbol), Route{0, 0});
+        if(inserted) { // new symbol, assign the symbols to the matchers round robin
+            booksPerShard.resize(matchers.size(), 0);
+            uint32_t shard = uint32_t((routes.size() - 1) % matchers.size());
+            it->second = Route{shard, booksPerShard[shard]++};
+        }
+        auto& matcher = *matchers[it->second.shard];
+        push(matcher.input, ShardMessage{bm, it->second.book});
+        matcher.inputReady.ring();
+        return true;
+    }
+
+    void writeOutput() {
+        size_t active = matchers.size();
+        vector<bool> finished(matchers.size(), false);
+        size_t i = 0;
+        size_t idle = 0;
+        bool unflushed = false;
+        while(active > 0) {
+            i = (i + 1) % matchers.size();
+            if(finished[i]) {
+                continue;
+            }
+            auto& q = matchers[i]->output;
+            if(!q.front()) {
+                if(++idle >= matchers.size()) { // nothing anywhere, let a live reader see what is written
+                    idle = 0;
+                    if(unflushed) {
+                        os.flush();
+                        unflushed = false;
+                    }
+                    outputReady.wait([this, &finished]() {
+                        for(size_t k=0; k<matchers.size(); ++k) {
+                            if(!finished[k] && matchers[k]->output.front()) {
+                                return true;
+                            }
+                        }
+                        return false;
+                    });
+                }
+                continue;
+            }
+            idle = 0;
+            // write every complete message queued by this matcher, never stop in the middle of one
+            while(auto pc = q.front()) {
+                os.write(pc->data, pc->len);
+                unflushed = true;
+                bool last = pc->last;
+                bool done = pc->done;
+                q.popFront();
+                if(done) {
+                    finished[i] = true;
+                    --active;
+                    break;
+                }
+                if(last && !q.front()) {
+                    break;
+                }
+                while(!last && !q.front()) { // rest of the message is still being produced
+                    std::this_thread::yield();
+                }
+            }
+        }
+        os.flush();
+    }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "../sample1/CircularQueue.hpp"
+
+// TopOfBook hands the best levels of a book from the matching thread to any number of reader threads
+// (risk, quoting, monitoring) through a seqlock. The writer makes the sequence odd, stores the levels and
+// makes it even again. A reader copies the levels between two reads of the sequence and retries if it saw
+// an odd or changed sequence, so readers never block the writer and never see a half written book.
+// The levels are kept in atomic words (relaxed, ordered by fences) so the concurrent copy is well defined.
+// Publishing the best bid and ask is five word stores and two sequence stores.
+
+struct BookLevel {
+    int64_t price;
+    int64_t qty;
+};
+
+struct TopOfBookView {
+    static constexpr size_t maxLevels = 5;
+    uint32_t bidLevels = 0;  // levels filled in bids, best first
+    uint32_t askLevels = 0;
+    BookLevel bids[maxLevels] = {};
+    BookLevel asks[maxLevels] = {};
+};
+
+class alignas(CACHE_LINE) TopOfBook {
+public:
+    TopOfBook() {
+        for(auto& w: data) {
+            w.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // single writer. only the first levels of each side are stored
+    void publish(const TopOfBookView& v, size_t levels) {
+        uint64_t counts;
+        memcpy(&counts, &v, sizeof(counts));
+        auto s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        data[0].store(counts, std::memory_order_relaxed);
+        for(size_t i=0; i<levels; ++i) {
+            data[bidsWord + 2*i].store(uint64_t(v.bids[i].price), std::memory_order_relaxed);
+            data[bidsWord + 2*i + 1].store(uint64_t(v.bids[i].qty), std::memory_order_relaxed);
+            data[asksWord + 2*i].store(uint64_t(v.asks[i].price), std::memory_order_relaxed);
+            data[asksWord + 2*i + 1].store(uint64_t(v.asks[i].qty), std::memory_order_relaxed);
+        }
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    // lock free, retries while the writer is in the middle of a publish
+    TopOfBookView read() const {
+        uint64_t words[wordCount];
+        while(true) {
+            auto s1 = seq.load(std::memory_order_acquire);
+            if(s1 & 1) {
+                continue;
+            }
+            for(size_t i=0; i<wordCount; ++i) {
+                words[i] = data[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(seq.load(std::memory_order_relaxed) == s1) {
+                break;
+            }
+        }
+        TopOfBookView v;
+        memcpy(&v, words, sizeof(v));
+        return v;
+    }
+
+    uint64_t version() const { return seq.load(std::memory_order_acquire) / 2; }  // publishes so far
+
+private:
+    static_assert(std::is_trivially_copyable<TopOfBookView>::value && sizeof(TopOfBookView) % 8 == 0,
+                  "TopOfBookView must copy as whole words");
+    static constexpr size_t wordCount = sizeof(TopOfBookView) / 8;
+    static constexpr size_t bidsWord = offsetof(TopOfBookView, bids) / 8;
+    static constexpr size_t asksWord = offsetof(TopOfBookView, asks) / 8;
+
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> data[wordCount];
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../sample1/CircularQueue.hpp"
+#include "../sample2/TradeStat.hpp"
+#include "Doorbell.hpp"
+#include "Journal.hpp"
+
+// TradeStatFeed keeps sample2's TradeStat (per symbol max time gap, volume, VWAP and max price) current
+// while the engines match. Every matching thread is a producer with its own lock free SPSC ring of
+// compact TradeEvents; one aggregator thread drains the rings into the TradeStat, so there is no text
+// formatting or parsing on the way. push() never waits: when a ring is full the trade is counted in
+// dropped() and the producer goes on. The aggregator sleeps while there are no trades. snapshot() copies the statistics at any time from any thread,
+// requestSnapshot() has the aggregator write them to a file (sample2 output format).
+
+struct TradeEvent {
+    int64_t timestamp;  // nanoseconds since the epoch
+    char symbol[8];     // zero padded
+    int64_t price;
+    int32_t quantity;
+    uint32_t reserved;
+};
+static_assert(sizeof(TradeEvent) == 32, "TradeEvent layout");
+
+class TradeStatFeed {
+public:
+    explicit TradeStatFeed(size_t producers = 1) {
+        for(size_t i=0; i<std::max<size_t>(producers, 1); ++i) {
+            rings.emplace_back(new Producer);
+        }
+        aggregator = std::thread([this]() { aggregate(); });
+    }
+
+    ~TradeStatFeed() {
+        stop.store(true, std::memory_order_release);
+        work.ring();
+        aggregator.join();
+    }
+
+    TradeStatFeed(const TradeStatFeed&) = delete;
+    TradeStatFeed& operator=(const TradeStatFeed&) = delete;
+
+    size_t producers() const { return rings.size(); }
+
+    // called by the one thread owning producer
+    bool push(size_t producer, const TradeEvent& ev) {
+        auto& p = *rings[producer];
+        if(!p.ring.enQueue(ev)) { // aggregator is behind, the matching thread does not wait for it
+            p.dropped.store(p.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        work.ring();
+        return true;
+    }
+
+    // wait until the aggregator has applied every trade pushed so far
+    void drain() const {
+        for(auto& p: rings) {
+            while(!p->ring.empty()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // consistent copy of the statistics, trades still in the rings are not in it
+    TradeStat snapshot() const {
+        std::lock_guard<std::mutex> lock(statMutex);
+        return stats;
+    }
+
+    // the aggregator writes the statistics to path (replaced atomically) when it next runs.
+    // only sets a flag, safe in a signal handler
+    void requestSnapshot() { snapshotRequested.store(true, std::memory_order_relaxed); }
+
+    void setSnapshotFile(const std::string& path) {
+        std::lock_guard<std::mutex> lock(statMutex);
+        snapshotFile = path;
+    }
+
+    void writeSnapshotTo(const std::string& path) const {
+        std::ostringstream oss;
+        oss << snapshot();
+        auto text = oss.str();
+        writeFileAtomically(path, text.data(), text.size());
+    }
+
+    uint64_t dropped() const {
+        uint64_t n = 0;
+        for(auto& p: rings) {
+            n += p->dropped.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    static constexpr size_t ringSize = 65536;
+    static constexpr size_t maxBatch = 256;  // trades applied per lock
+    // a snapshot request comes from a signal handler, which can not ring: the idle aggregator looks this often
+    static constexpr std::chrono::milliseconds snapshotPoll{10};
+
+    struct Producer {
+        CircularQueue<TradeEvent, ringSize> ring;
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    std::vector<std::unique_ptr<Producer>> rings;
+    mutable std::mutex statMutex;   // the aggregator holds it while applying a batch
+    TradeStat stats;
+    std::string snapshotFile;
+    std::atomic<bool> snapshotRequested{false};
+    std::atomic<bool> stop{false};
+    Doorbell work;
+    std::thread aggregator;
+
+    bool hasWork() const {
+        if(stop.load(std::memory_order_acquire) || snapshotRequested.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        for(auto& p: rings) {
+            if(!p->ring.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void aggregate() {
+        std::string symbol;
+        while(true) {
+            bool idle = true;
+            for(auto& p: rings) {
+                std::lock_guard<std::mutex> lock(statMutex);
+                // a trade leaves the ring after it is applied, so an empty ring means everything is in stats
+                for(size_t n=0; n<maxBatch; ++n) {
+                    auto pev = p->ring.front();
+                    if(!pev) {
+                        break;
+                    }
+                    symbol.assign(pev->symbol, strnlen(pev->symbol, sizeof(pev->symbol)));
+                    stats.addTrade(pev->timestamp, symbol, pev->quantity, pev->price);
+                    p->ring.popFront();
+                    idle = false;
+                }
+            }
+            if(snapshotRequested.exchange(false, std::memory_order_relaxed)) {
+                std::string path;
+                {
+                    std::lock_guard<std::mutex> lock(statMutex);
+                    path = snapshotFile;
+                }
+                try {
+                    if(!path.empty()) {
+                        writeSnapshotTo(path);
+                    }
+                }
+                catch(const std::exception& e) { // keep aggregating, the next request may succeed
+                    std::cerr << e.what() << "\n";
+                }
+            }
+            if(idle) {
+                if(stop.load(std::memory_order_acquire)) {
+                    break;
+                }
+                work.waitFor([this]() { return hasWork(); }, snapshotPoll);
+            }
+        }
+    }
+};
@@ -0,0 +1,544 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MatchEngine.hpp"
+#include "ShardedMatchEngine.hpp"
+#include "OrderFlowGenerator.hpp"
+
+using namespace std;
+
+#define CHECK(expr) \
+    do { \
+        if(!(expr)) { \
+             std::ostringstream oss; \
+             oss << "Failed at line: " << __LINE__ << "`" #expr "` "; \
+             return oss.str(); \
+        } \
+     } while(0)
+
+// golden checksums of the engine output for generated flows, taken from the original engine.
+// a change to the book, the pool or the parser must not change them
+struct GoldenFlow {
+    OrderFlowConfig cfg;
+    size_t messages;
+    uint64_t checksum;
+};
+
+vector<GoldenFlow> goldenFlows() {
+    vector<GoldenFlow> flows(3);
+    flows[0].messages = 200000;
+    flows[0].checksum = 0x9177b91be82f4bdcULL;
+
+    flows[1].cfg.seed = 11;
+    flows[1].cfg.iocRatio = 0.3;
+    flows[1].cfg.crossRatio = 0.3;
+    flows[1].cfg.printWeight = 0.002;
+    flows[1].cfg.depthLevels = 10;
+    flows[1].cfg.meanLifetime = 300;
+    flows[1].cfg.maxLive = 2000;
+    flows[1].messages = 50000;
+    flows[1].checksum = 0xc90557bdcbc38929ULL;
+
+    flows[2].cfg.seed = 5;
+    flows[2].cfg.newWeight = 0.5;
+    flows[2].cfg.modifyWeight = 0.4;
+    flows[2].cfg.cancelWeight = 0.1;
+    flows[2].cfg.meanDistance = 1;
+    flows[2].cfg.driftRatio = 0.05;
+    flows[2].messages = 50000;
+    flows[2].checksum = 0xebfd0562c98fbe67ULL;
+    return flows;
+}
+
+string generate(const GoldenFlow& flow) {
+    string text;
+    OrderFlowGenerator gen(flow.cfg);
+    gen.generate(flow.messages, text);
+    return text;
+}
+
+string test1() {
+    // sample input against its recorded output
+    ifstream in("sample.in");
+    ifstream expected("test/sample.out");
+    CHECK(in && expected);
+    ostringstream out;
+    MatchEngine engine(in, out);
+    engine.run();
+    CHECK(out.str() == string(istreambuf_iterator<char>(expected), istreambuf_iterator<char>()));
+    return "test1 OK";
+}
+
+string test2() {
+    // same config, same flow. another seed, another flow
+    GoldenFlow flow = goldenFlows()[1];
+    string a = generate(flow);
+    CHECK(a == generate(flow));
+    flow.cfg.seed = 12;
+    CHECK(a != generate(flow));
+    return "test2 OK";
+}
+
+string test3() {
+    // text replay of the generated flows gives the golden output
+    for(auto& flow: goldenFlows()) {
+        istringstream in(generate(flow));
+        OutputChecksum checksum;
+        ostream out(&checksum);
+        MatchEngine engine(in, out);
+        engine.run();
+        CHECK(checksum.value() == flow.checksum);
+    }
+    return "test3 OK";
+}
+
+string test4() {
+    // binary replay, small slabs and asynchronous output give the same output
+    for(auto& flow: goldenFlows()) {
+        istringstream text(generate(flow));
+        ostringstream bin;
+        convertTextToBinary(text, bin);
+        string records = bin.str();
+        OutputChecksum checksum;
+        ostream out(&checksum);
+        {
+            MatchEngine engine(std::cin, out, OrderMemoryPool::Options{16}, TradePublisher::Mode::ASYNC);
+            engine.runBinary((const BinaryMessage*)records.data(), records.size() / sizeof(BinaryMessage));
+        }
+        CHECK(checksum.value() == flow.checksum);
+        for(size_t batch: {1, 16}) { // the same records from a stream, in batches
+            istringstream in(records);
+            OutputChecksum streamed;
+            ostream sout(&streamed);
+            {
+                MatchEngine engine(in, sout);
+                engine.runBinaryBatched(batch);
+            }
+            CHECK(streamed.value() == flow.checksum);
+        }
+    }
+    {
+        // the output thread goes to sleep when it has nothing to do, and wakes up for the next trade
+        istringstream in;
+        ostringstream out;
+        MatchEngine engine(in, out, OrderMemoryPool::Options{16}, TradePublisher::Mode::ASYNC);
+        engine.processInputLine("NEW BUY GFD 100 10 a");
+        engine.processInputLine("NEW SELL GFD 100 4 b");
+        this_thread::sleep_for(chrono::milliseconds(50));
+        engine.processInputLine("NEW SELL GFD 100 6 c");
+        engine.flushOutput();
+        CHECK(out.str() == "TRADE a 100 4 b 100\nTRADE a 100 6 c 100\n");
+    }
+    return "test4 OK";
+}
+
+string test5() {
+    // a restart recovered from snapshot and journal continues as if there was no restart
+    GoldenFlow flow = goldenFlows()[1];
+    string text = generate(flow);
+    size_t half = 0;
+    for(size_t i=0; i<flow.messages / 2; ++i) {
+        half = text.find('\n', half) + 1;
+    }
+    const string journalFile = "test/journal.tmp";
+    const string snapshotFile = "test/snapshot.tmp";
+    ostringstream before;
+    ostringstream after;
+    {
+        istringstream in(text.substr(0, half));
+        MatchEngine engine(in, before);
+        engine.enableJournal(journalFile, JournalWriter::Options{16}, snapshotFile, 1000);
+        engine.run();
+    }
+    {
+        istringstream in(text.substr(half));
+        MatchEngine engine(in, after);
+        CHECK(engine.recover(snapshotFile, journalFile) < 1000);
+        engine.enableJournal(journalFile, JournalWriter::Options{16}, snapshotFile, 1000);
+        engine.run();
+    }
+    remove(journalFile.c_str());
+    remove(snapshotFile.c_str());
+    OutputChecksum checksum;
+    ostream out(&checksum);
+    out << before.str() << after.str();
+    CHECK(checksum.value() == flow.checksum);
+    // trades wait for the journal group of their message, an idle engine commits it
+    for(auto mode: {TradePublisher::Mode::INLINE, TradePublisher::Mode::ASYNC}) {
+        istringstream in;
+        ostringstream out;
+        vector<char> data;
+        {
+            MatchEngine engine(in, out, OrderMemoryPool::Options{256}, mode);
+            engine.enableJournal(journalFile, JournalWriter::Options{64, chrono::microseconds(0)});
+            engine.processInputLine("NEW BUY GFD 100 10 a");
+            engine.processInputLine("NEW SELL GFD 100 4 b");
+            CHECK(readFileFrom(journalFile, 0, data) && data.empty());
+            if(mode == TradePublisher::Mode::INLINE) {
+                CHECK(out.str().empty());
+            }
+            engine.run();  // no input: commits before it would wait
+            engine.flushOutput();
+            CHECK(out.str() == "TRADE a 100 4 b 100\n");
+            CHECK(readFileFrom(journalFile, 0, data) && !data.empty());
+        }
+        remove(journalFile.c_str());
+    }
+    return "test5 OK";
+}
+
+string test6() {
+    // a reader thread sees only consistent books while the engine runs, and the final book at the end
+    GoldenFlow flow = goldenFlows()[0];
+    istringstream in(generate(flow));
+    OutputChecksum checksum;
+    ostream out(&checksum);
+    MatchEngine engine(in, out);
+    auto& top = engine.enableTopOfBook(3);
+    atomic<bool> stop{false};
+    atomic<bool> consistent{true};
+    std::thread reader([&]() {
+        while(!stop.load()) {
+            auto v = top.read();
+            bool ok = v.bidLevels <= 3 && v.askLevels <= 3;
+            for(size_t i=1; ok && i<v.bidLevels; ++i) {
+                ok = v.bids[i].price < v.bids[i-1].price;
+            }
+            for(size_t i=1; ok && i<v.askLevels; ++i) {
+                ok = v.asks[i].price > v.asks[i-1].price;
+            }
+            if(ok && v.bidLevels && v.askLevels) {
+                ok = v.bids[0].price < v.asks[0].price;  // the book is never crossed between messages
+            }
+            if(!ok) {
+                consistent = false;
+            }
+        }
+    });
+    engine.run();
+    stop = true;
+    reader.join();
+    CHECK(consistent);
+    CHECK(checksum.value() == flow.checksum);
+    CHECK(top.version() > 0);
+    auto v = top.read();
+    CHECK(v.bidLevels == 3 && v.askLevels == 3);
+    for(size_t i=0; i<3; ++i) {
+        CHECK(v.bids[i].qty > 0 && v.asks[i].qty > 0);
+    }
+    // with a journal readers see a book only when its messages are committed
+    const string journalFile = "test/journal.tmp";
+    {
+        istringstream none;
+        ostringstream ignored;
+        MatchEngine held(none, ignored);
+        auto& heldTop = held.enableTopOfBook(1);
+        held.enableJournal(journalFile, JournalWriter::Options{64, chrono::microseconds(0)});
+        held.processInputLine("NEW BUY GFD 100 10 a");
+        CHECK(heldTop.read().bidLevels == 0);
+        held.commitJournal();
+        auto hv = heldTop.read();
+        CHECK(hv.bidLevels == 1 && hv.bids[0].price == 100 && hv.bids[0].qty == 10);
+    }
+    remove(journalFile.c_str());
+    return "test6 OK";
+}
+
+string test7() {
+    // batch mode with prefetching processes in the original order: same output for any batch size
+    for(auto& flow: goldenFlows()) {
+        for(size_t batch: {2, 16, 64}) {
+            istringstream in(generate(flow));
+            OutputChecksum checksum;
+            ostream out(&checksum);
+            MatchEngine engine(in, out);
+            engine.runBatched(batch);
+            CHECK(checksum.value() == flow.checksum);
+        }
+    }
+    return "test7 OK";
+}
+
+string test8() {
+    // mass cancel removes only the owner's orders in the given side and price range, also through recovery
+    string text =
+        "NEW BUY GFD 100 10 a1 alice\n"
+        "NEW BUY GFD 100 5 b1 bob\n"
+        "NEW BUY GFD 99 7 a2 alice\n"
+        "NEW SELL GFD 105 3 a3 alice\n"
+        "NEW SELL GFD 106 4 a4 alice\n"
+        "NEW SELL GFD 106 2 c1\n"
+        "MODIFY a2 BUY 98 7\n"
+        "MASSCANCEL alice SELL 106 200\n"
+        "PRINT\n"
+        "MASSCANCEL alice\n"
+        "PRINT\n"
+        "NEW BUY GFD 100 1 a1 alice\n"
+        "MASSCANCEL bob BUY\n"
+        "PRINT\n";
+    const string expected =
+        "SELL:\n106 2\n105 3\nBUY:\n100 15\n98 7\n"
+        "SELL:\n106 2\nBUY:\n100 5\n"
+        "SELL:\n106 2\nBUY:\n";
+    {
+        istringstream in(text);
+        ostringstream out;
+        MatchEngine engine(in, out);
+        engine.run();
+        CHECK(out.str() == expected);
+    }
+    const string journalFile = "test/journal.tmp";
+    const string snapshotFile = "test/snapshot.tmp";
+    size_t split = text.find("MASSCANCEL alice\n");
+    ostringstream before;
+    ostringstream after;
+    {
+        istringstream in(text.substr(0, split));
+        MatchEngine engine(in, before);
+        engine.enableJournal(journalFile, JournalWriter::Options{1}, snapshotFile, 4);
+        engine.run();
+    }
+    {
+        istringstream in(text.substr(split));
+        MatchEngine engine(in, after);
+        engine.recover(snapshotFile, journalFile);
+        engine.run();
+    }
+    remove(journalFile.c_str());
+    remove(snapshotFile.c_str());
+    CHECK(before.str() + after.str() == expected);
+    // an owner field, not a stray blank: these stay bad input as without owners
+    OrderMessage m;
+    CHECK(parseInputLine("NEW BUY GFD 5 10 r o", m, false) && m.owner == "o");
+    CHECK(!parseInputLine("NEW BUY GFD 5 10 r ", m, false));
+    CHECK(!parseInputLine("NEW BUY GFD  5 10 r", m, false));
+    return "test8 OK";
+}
+
+string test9() {
+    // the live trade statistics agree with sample2's TradeStat over the printed trades (the time gaps
+    // are measured live, so only their presence is checked)
+    GoldenFlow flow = goldenFlows()[1];
+    istringstream in(generate(flow));
+    ostringstream out;
+    TradeStatFeed feed;
+    {
+        MatchEngine engine(in, out);
+        engine.enableTradeStats(feed, "SYM");
+        engine.run();
+    }
+    feed.drain();
+    CHECK(feed.dropped() == 0);
+    TradeStat expected;
+    istringstream trades(out.str());
+    string line;
+    while(getline(trades, line)) {
+        istringstream fields(line);
+        string type, idBook;
+        long price;
+        int qty;
+        if(fields >> type >> idBook >> price >> qty && type == "TRADE") {
+            expected.addTrade(0, "SYM", qty, price);
+        }
+    }
+    ostringstream live;
+    ostringstream text;
+    live << feed.snapshot();
+    text << expected;
+    auto withoutGap = [](const string& s) { // SYM,<gap>,<volume>,<vwap>,<max>
+        auto first = s.find(',');
+        return s.substr(0, first) + s.substr(s.find(',', first + 1));
+    };
+    CHECK(!text.str().empty());
+    CHECK(withoutGap(live.str()) == withoutGap(text.str()));
+    // with a journal a trade reaches the statistics only after its journal group is committed
+    const string journalFile = "test/journal.tmp";
+    {
+        TradeStatFeed held;
+        istringstream none;
+        ostringstream ignored;
+        MatchEngine engine(none, ignored);
+        engine.enableTradeStats(held, "SYM");
+        engine.enableJournal(journalFile, JournalWriter::Options{64, chrono::microseconds(0)});
+        engine.processInputLine("NEW BUY GFD 100 10 a");
+        engine.processInputLine("NEW SELL GFD 100 4 b");
+        held.drain();
+        ostringstream before;
+        before << held.snapshot();
+        CHECK(before.str().empty());
+        engine.commitJournal();
+        held.drain();
+        ostringstream after;
+        after << held.snapshot();
+        CHECK(after.str().find(",4,100,100") != string::npos);
+    }
+    remove(journalFile.c_str());
+    return "test9 OK";
+}
+
+string test10() {
+    // a canceled order gives its slot back at once, also behind an order that keeps the level alive
+    string text = "NEW BUY GFD 100 1 anchor\n";
+    for(int i=0; i<10000; ++i) {
+        text += "NEW BUY GFD 100 5 o" + to_string(i) + "\nCANCEL o" + to_string(i) + "\n";
+    }
+    text += "PRINT\n";
+    istringstream in(text);
+    ostringstream out;
+    MatchEngine engine(in, out, OrderMemoryPool::Options{16});
+    engine.run();
+    CHECK(out.str() == "SELL:\nBUY:\n100 1\n");
+    CHECK(engine.orderPool().liveCount() == 1);
+    CHECK(engine.orderPool().capacity() == 16);
+
+    // with huge pages a slab holds as many orders as its pages fit
+    OrderMemoryPool pool(OrderMemoryPool::Options{256, 1, true});
+    CHECK(pool.capacity() == 2 * 1024 * 1024 / sizeof(Order));
+    return "test10 OK";
+}
+
+string test11() {
+    // erase keeps the open addressing table consistent without tombstones: random inserts and erases of
+    // few ids checked against std::set, the table stays small so clusters are long and wrap around
+    OrderIdIndex index(4);
+    set<string> expected;
+    mt19937_64 rng(7);
+    for(int step=0; step<200000; ++step) {
+        auto r = rng();
+        string id = "id" + to_string(r % 300);
+        if((r >> 32) % 3 == 0) {
+            CHECK(index.erase(id) == (expected.erase(id) == 1));
+        }
+        else {
+            CHECK(index.tryEmplace(id).second == expected.insert(id).second);
+        }
+        CHECK(index.size() == expected.size());
+    }
+    for(int i=0; i<300; ++i) {
+        string id = "id" + to_string(i);
+        auto pe = index.find(id);
+        CHECK((pe != nullptr) == (expected.count(id) == 1));
+        CHECK(!pe || pe->id.view() == id);
+    }
+    return "test11 OK";
+}
+
+string test12() {
+    // the sharded engine gives every symbol of an interleaved input the output of a single engine
+    vector<string> symbols{"AAA", "BBB", "CCC", "DDD", "EEE"};
+    vector<string> expected;
+    vector<vector<string>> flows;
+    for(size_t k=0; k<symbols.size(); ++k) {
+        GoldenFlow flow = goldenFlows()[1];
+        flow.cfg.seed = 100 + k;
+        flow.messages = 5000;
+        istringstream in(generate(flow));
+        ostringstream out;
+        MatchEngine engine(in, out);
+        engine.run();
+        expected.push_back(out.str());
+        flows.emplace_back();
+        istringstream lines(generate(flow));
+        for(string line; getline(lines, line); ) {
+            flows.back().push_back(symbols[k] + " " + line);
+        }
+    }
+    string input;  // round robin over the symbols
+    for(size_t i=0; i<5000; ++i) {
+        for(auto& f: flows) {
+            input += f[i] + "\n";
+        }
+    }
+    for(size_t shards: {1, 2, 3, 4}) {
+        istringstream in(input);
+        ostringstream out;
+        {
+            // 4: the books on huge pages (or their fallback)
+            OrderMemoryPool::Options poolOpts{64, 1, shards == 4, shards == 4};
+            ShardedMatchEngine engine(shards, in, out, 1, nullptr, poolOpts);
+            engine.run();
+        }
+        vector<string> got(symbols.size());
+        istringstream lines(out.str());
+        for(string line; getline(lines, line); ) {
+            auto sp = line.find(' ');
+            auto it = find(symbols.begin(), symbols.end(), line.substr(0, sp));
+            CHECK(it != symbols.end());
+            got[it - symbols.begin()] += line.substr(sp + 1) + "\n";
+        }
+        for(size_t k=0; k<symbols.size(); ++k) {
+            CHECK(got[k] == expected[k]);
+        }
+    }
+    return "test12 OK";
+}
+
+string test13() {
+    // a subscriber rebuilding the book from the DEPTH lines ends with the book of the final PRINT
+    for(auto& flow: goldenFlows()) {
+        istringstream in(generate(flow) + "PRINT\n");
+        ostringstream out;
+        ostringstream depthOut;
+        {
+            MatchEngine engine(in, out);
+            engine.enableDepthFeed(depthOut);
+            engine.run();
+        }
+        DepthBook book;
+        istringstream updates(depthOut.str());
+        size_t count = 0;
+        for(string line; getline(updates, line); ++count) {
+            DepthUpdate u;
+            CHECK(parseDepthLine(line, u));
+            CHECK(book.apply(u));
+            CHECK(u.action == DepthAction::DELETE || u.quantity > 0);
+        }
+        CHECK(count > 0 && book.sequence() == count);
+        ostringstream rebuilt;  // PRINT format: both sides from the highest price down
+        rebuilt << "SELL:\n";
+        for(auto it=book.sellSide().rbegin(); it!=book.sellSide().rend(); ++it) {
+            rebuilt << it->first << " " << it->second << "\n";
+        }
+        rebuilt << "BUY:\n";
+        for(auto it=book.buySide().rbegin(); it!=book.buySide().rend(); ++it) {
+            rebuilt << it->first << " " << it->second << "\n";
+        }
+        string text = out.str();
+        CHECK(text.size() >= rebuilt.str().size());
+        CHECK(text.compare(text.size() - rebuilt.str().size(), string::npos, rebuilt.str()) == 0);
+    }
+    // only real level changes are sent: a modify to the same quantity is none
+    istringstream in("NEW BUY GFD 100 5 a\nMODIFY a BUY 100 5\nMODIFY a BUY 100 3\n");
+    ostringstream out;
+    ostringstream depthOut;
+    {
+        MatchEngine engine(in, out);
+        engine.enableDepthFeed(depthOut);
+        engine.run();
+    }
+    CHECK(depthOut.str() == "DEPTH 1 BUY ADD 100 5\nDEPTH 2 BUY CHANGE 100 3\n");
+    return "test13 OK";
+}
+
+int main() {
+    cout << test1() << endl;
+    cout << test2() << endl;
+    cout << test3() << endl;
+    cout << test4() << endl;
+    cout << test5() << endl;
+    cout << test6() << endl;
+    cout << test7() << endl;
+    cout << test8() << endl;
+    cout << test9() << endl;
+    cout << test10() << endl;
+    cout << test11() << endl;
+    cout << test12() << endl;
+    cout << test13() << endl;
+}